@@ -1,4 +1,5 @@
 #pragma once
+#include <atomic>
 #include <cstdint>
 #include <gmp.h>
 #include <string>
@@ -8,15 +9,65 @@
 namespace pi {
 
 struct PowerPair;
+struct DigitSink;
 
 class BaseConverter {
 public:
-  static void parallel_to_str(mpz_t n, int64_t total_digits, char *out_buf);
+  // Pieces of at least this many digits are split by parallel tasks, each
+  // holding its own copy of its half; smaller ones are converted serially
+  static constexpr int64_t TASK_MIN_DIGITS = 1000000;
+
+  // The digits of 0 <= n < 10^total_digits, zero-padded, by dividing by
+  // powers of ten at every node. Every converter writes exactly
+  // total_digits characters, with no terminator, so out_buf can be a
+  // window of the output file.
+  static void parallel_to_str(mpz_t n, int64_t total_digits, char *out_buf,
+                              int64_t task_min_digits = TASK_MIN_DIGITS);
+
+  // The first total_digits digits after the point of y / 2^bits, by the
+  // scaled remainder tree: every node splits its fraction into the leading
+  // bits, for its first half of the digits, and the middle product with a
+  // power of ten, for the second, so no node divides. False when some
+  // leaf landed too close to a digit boundary for the truncation errors,
+  // leaving out_buf unreliable.
+  static bool fraction_to_str(const mpz_t y, size_t bits,
+                              int64_t total_digits, char *out_buf,
+                              int64_t task_min_digits = TASK_MIN_DIGITS);
+
+  // The same digits packed 19 to a 64-bit word: word i holds digits 19i
+  // to 19i + 18 as the number they spell, a short last word padded with
+  // zeros on the right
+  static bool fraction_to_words(const mpz_t y, size_t bits,
+                                int64_t total_digits, uint64_t *words,
+                                int64_t task_min_digits = TASK_MIN_DIGITS);
+
+  // Packs total_digits ASCII digits into words as fraction_to_words() does
+  static void pack_words(const char *text, int64_t total_digits,
+                         uint64_t *words);
+
+  // The first total_digits hexadecimal digits (lowercase) after the point
+  // of y / 2^bits, read straight off its limbs
+  static void fraction_to_hex(const mpz_t y, size_t bits,
+                              int64_t total_digits, char *out_buf);
 
 private:
-  static void collect_powers(int64_t digits, std::vector<int64_t> &needed);
+  // Powers of ten for the splits of the division tree, or of the scaled
+  // remainder tree, whose high parts are whole words
+  static void collect_powers(int64_t digits, bool scaled,
+                             std::vector<int64_t> &needed);
+  static void build_powers(int64_t total_digits, bool scaled,
+                           std::vector<PowerPair> &powers);
   static void recursive_split(mpz_t n, int64_t digits, char *out,
-                              const std::vector<PowerPair> &powers);
+                              const std::vector<PowerPair> &powers,
+                              int64_t task_min_digits);
+  static bool fraction_to_sink(const mpz_t y, size_t bits,
+                               int64_t total_digits, const DigitSink &sink,
+                               int64_t task_min_digits);
+  static void scaled_split(mpz_t y, int64_t digits, int64_t at,
+                           const DigitSink &sink,
+                           const std::vector<PowerPair> &powers,
+                           int64_t task_min_digits,
+                           std::atomic<bool> &ambiguous);
 };
 
 } // namespace pi
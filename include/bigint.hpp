@@ -46,12 +46,14 @@ public:
   void mul(const BigInt &other) { mpz_mul(value, value, other.value); }
   void mul_small(uint64_t val) { mpz_mul_ui(value, value, val); }
 
-  static void binary_split(int64_t a, int64_t b, BigInt &P, BigInt &Q,
-                           BigInt &T);
-
   static void parallel_pow_ui(mpz_t rop, uint64_t base, uint64_t exp);
-  static void parallel_sqrt(mpz_t rop, const mpz_t n);
-  static void parallel_div(mpz_t q, const mpz_t num, const mpz_t den);
+  // sqrt(c) * 2^k, within a few units in the last place
+  static void parallel_sqrt_ui(mpz_t rop, unsigned long c, size_t k);
+  // floor(num / den) for positive operands when it has at most `bits`
+  // bits; a longer quotient is within a unit in its top `bits` bits, with
+  // zeros below. Only the leading bits of num and den this needs are read.
+  static void parallel_div(mpz_t q, const mpz_t num, const mpz_t den,
+                           size_t bits);
 
   void shift_left(size_t limbs) { mpz_mul_2exp(value, value, limbs * 64); }
 
@@ -0,0 +1,49 @@
+#pragma once
+#include <cstdint>
+#include <gmp.h>
+#include <initializer_list>
+#include <string>
+
+namespace pi {
+
+// Named sets of integers saved under a directory so an interrupted run can
+// pick up where it stopped. Each file holds the raw limbs of its integers
+// behind a header naming the run (decimal digits), the limb layout and a
+// checksum per integer; it is written under a temporary name, synced and
+// renamed, so a file that exists is complete. A file from a run of another
+// size, another limb layout, or with a bad checksum is ignored.
+class Checkpoint {
+public:
+  // Used by --resume when no --checkpoint directory is given
+  static constexpr const char *DEFAULT_DIR = "pi_calc.ckpt";
+
+  // Files go to dir, which is created if missing. Without resume nothing
+  // is loaded and the run starts over, overwriting what it saves again.
+  Checkpoint(std::string dir, int64_t digits, bool resume);
+
+  const std::string &directory() const { return dir; }
+  bool resuming() const { return resume; }
+
+  // Writes values under name; false, with a message, when the directory
+  // cannot take the file. A failed save never damages an older one.
+  bool save(const std::string &name,
+            std::initializer_list<mpz_srcptr> values) const;
+
+  // Reads name into values when resuming and the file matches this run
+  bool load(const std::string &name,
+            std::initializer_list<mpz_ptr> values) const;
+
+  void remove(const std::string &name) const;
+
+  // Removes every file whose name starts with prefix
+  void remove_all(const std::string &prefix) const;
+
+private:
+  std::string path(const std::string &name) const;
+
+  std::string dir;
+  int64_t digits;
+  bool resume;
+};
+
+} // namespace pi
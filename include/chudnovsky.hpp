@@ -0,0 +1,115 @@
+#pragma once
+#include "bigint.hpp"
+#include "checkpoint.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace pi {
+
+// Binary splitting of the Chudnovsky series: P, Q, T over terms
+// [0, terms). Everything a computation needs lives in the object, so
+// several can run in one process. Progress is counted per thread, with no
+// lock or shared counter on the recursion's path, and summed on demand by
+// completed().
+class ChudnovskySeries {
+public:
+  static constexpr uint64_t A = 13591409;
+  static constexpr uint64_t B = 545140134;
+
+  // C3_24 = 640320^3 / 24 = (2^15 3^2 5^3) (23^3 29^3), as two factors that
+  // each fit an unsigned long even where that is 32 bits
+  static constexpr unsigned long C3_24_LO = 36864000;
+  static constexpr unsigned long C3_24_HI = 296740963;
+
+  // Terms a leaf block evaluates directly instead of splitting further
+  static constexpr int64_t LEAF_TERMS = 16;
+
+  // Ranges above this size split into parallel tasks; smaller ones
+  // recurse serially to bound the memory in flight
+  static constexpr int64_t TASK_MIN_TERMS = 100000;
+
+  // Products a tasked merge runs at once: all four, T1 Q2 and P1 T2 before
+  // P1 P2 and Q1 Q2, or one after the other
+  static constexpr int MERGE_BREADTH = 4;
+
+  // Largest range that still carries the prime factorizations of its P and
+  // Q when common factors are removed. Above it the lists grow long and the
+  // exact divisions run on operands GMP no longer handles quickly.
+  static constexpr int64_t FACTOR_MAX_TERMS = 1 << 18;
+
+  // With reduce_gcd, each merge divides P1 and Q2 by their common factors
+  // before multiplying (see split()), using a smallest-prime-factor sieve
+  // over [1, 6 terms]. P, Q and T come out smaller by the same factor, so
+  // Q / T and the digits are unchanged.
+  explicit ChudnovskySeries(int64_t terms, bool reduce_gcd = false);
+  ~ChudnovskySeries();
+
+  int64_t terms() const { return total; }
+
+  // Upper bounds on the bits of P, Q and T over terms [a, b), as used to
+  // size the outputs of every split
+  static void bound_bits(int64_t a, int64_t b, size_t &p_bits, size_t &q_bits,
+                         size_t &t_bits);
+
+  // Overrides TASK_MIN_TERMS and MERGE_BREADTH (4, 2 or 1), for runs that
+  // have to fit a memory budget
+  void set_granularity(int64_t task_min_terms, int merge_breadth) {
+    this->task_min_terms = task_min_terms;
+    this->merge_breadth = merge_breadth;
+  }
+
+  // Saves every subtree of checkpoint_terms() terms to checkpoint as it
+  // completes, and on a resumed run loads the ones already saved instead of
+  // recomputing them. checkpoint must outlive compute().
+  void checkpoint_to(const Checkpoint *checkpoint) {
+    this->checkpoint = checkpoint;
+  }
+
+  // Size of the saved subtrees: about a sixteenth of the series, and never
+  // below FACTOR_MAX_TERMS, so no saved subtree has to carry factor lists
+  int64_t checkpoint_terms() const {
+    return std::max<int64_t>(total / 16, FACTOR_MAX_TERMS);
+  }
+
+  // Runs the splitting on the current team, opening one when called from
+  // serial code
+  void compute(BigInt &P, BigInt &Q, BigInt &T);
+
+  // Terms evaluated so far; callable from any thread while compute() runs
+  int64_t completed() const;
+
+private:
+  class FactorSieve;
+  struct Factors;
+
+  // factors, when non-null, receives the factorizations of P and Q
+  void split(int64_t a, int64_t b, BigInt &P, BigInt &Q, BigInt &T,
+             Factors *factors);
+
+  // split() of a checkpointed subtree
+  void split_unit(int64_t a, int64_t b, BigInt &P, BigInt &Q, BigInt &T);
+
+  // Divides P1 and Q2 by their common factors and, when factors is
+  // non-null, stores the factorizations of the merged P and Q
+  static void cancel_common(BigInt &P1, BigInt &Q2, Factors &left,
+                            Factors &right, Factors *factors);
+
+  // One counter per thread on its own cache line; only the owning thread
+  // adds to it
+  struct alignas(64) Counter {
+    std::atomic<int64_t> terms{0};
+  };
+
+  int64_t total;
+  int slots;
+  std::unique_ptr<Counter[]> counters;
+  bool reduce_gcd;
+  int64_t task_min_terms = TASK_MIN_TERMS;
+  int merge_breadth = MERGE_BREADTH;
+  const Checkpoint *checkpoint = nullptr;
+  std::unique_ptr<FactorSieve> sieve;
+};
+
+} // namespace pi
@@ -0,0 +1,72 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace pi {
+
+// The digits of the result ("3." and the decimals as text, or packed
+// words) laid out in memory as they will be on disk, so the base
+// converter writes its leaves straight into the output. On POSIX the data
+// is a shared mapping of the output files: the digits live in the page
+// cache, which writes them back while the conversion runs, and no copy of
+// them is held in RAM. Elsewhere it is a buffer written out by close().
+//
+// With a shard size the data is cut into files of that many bytes (the
+// last one shorter), named after the output with a four-digit index
+// ("pi_0000.txt", "pi_0001.txt", ...); for text the first starts with
+// "3.", and concatenating them gives the unsharded file. A format with
+// headers gives each file a header of its own ahead of its share of the
+// data. Files are created under a ".part" suffix and only renamed into
+// place by close(), so a run that stops early leaves no complete-looking
+// output.
+class DigitOutput {
+public:
+  // True where the data is a file mapping rather than a buffer in RAM
+  static const bool MAPPED;
+
+  DigitOutput() = default;
+  DigitOutput(const DigitOutput &) = delete;
+  DigitOutput &operator=(const DigitOutput &) = delete;
+  ~DigitOutput();
+
+  // Creates the files for `bytes` bytes of data and reserves their disk
+  // space. shard_bytes of 0 gives one file at path; other sizes are
+  // rounded up to shard_granularity(), as is header_bytes, the room left
+  // at the start of every file for set_header(). False, printing the
+  // reason, when the files cannot be created.
+  bool open(const std::string &path, size_t bytes, size_t shard_bytes = 0,
+            size_t header_bytes = 0);
+
+  // Shards and headers must end on page boundaries of the files
+  static size_t shard_granularity();
+
+  char *data() { return base; }
+  const char *data() const { return base; }
+  size_t length() const { return bytes; }
+  size_t shard_length() const { return shard; }
+  size_t header_length() const { return header; }
+  const std::vector<std::string> &files() const { return paths; }
+
+  // The header of one file, written by close(); at most header_length()
+  // bytes, the rest of the room staying zero
+  void set_header(size_t file, std::string text);
+
+  // Flushes the data and headers to their files and renames them into
+  // place; true when every file was written
+  bool close();
+
+private:
+  void discard();
+
+  char *base = nullptr;
+  size_t bytes = 0;    // length of the data
+  size_t reserved = 0; // address space (or buffer) behind base
+  size_t shard = 0;    // bytes of data per file
+  size_t header = 0;   // bytes ahead of the data in every file
+  std::vector<std::string> paths;
+  std::vector<std::string> headers;
+};
+
+} // namespace pi
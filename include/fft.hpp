@@ -0,0 +1,39 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <gmp.h>
+
+namespace pi {
+
+// Double-precision complex FFT multiplier. Operands are cut into balanced
+// signed chunks of a few bits, both are packed into one complex vector
+// (a + i*b) so a product costs one forward and one inverse transform, and
+// the chunk width is chosen per call from a rigorous rounding-error bound.
+//
+// src/fft.cpp is built without -ffast-math: the bound assumes every
+// floating-point operation is correctly rounded and evaluated as written.
+class FFTMultiplier {
+public:
+  // 2^25 points of 16 bytes; longer products go through Toom-Cook
+  static constexpr int MAX_LOG_LEN = 25;
+  static constexpr int MIN_CHUNK_BITS = 8;
+  static constexpr int MAX_CHUNK_BITS = 20;
+
+  // Worst-case absolute error of any output coefficient of a length-n
+  // convolution whose inputs have Euclidean norms with product norm2.
+  // After Percival, "Rapid multiplication modulo the sum and difference
+  // of highly composite numbers" (2003), Theorem 5.1.
+  static double error_bound(size_t n, double norm2);
+
+  // Widest chunk whose bound stays below 1/2 for |op1| * |op2| of the
+  // given bit sizes, and the transform length it needs; 0 if none fits.
+  static int chunk_bits(size_t bits1, size_t bits2, bool square, size_t &n);
+
+  // rop = op1 * op2. Returns false and leaves rop untouched when no chunk
+  // width meets the bound or the outputs drift too far from integers, so
+  // the caller can fall back to the NTT. Must run inside a parallel
+  // region; op1 == op2 takes the squaring path.
+  static bool multiply(mpz_t rop, const mpz_t op1, const mpz_t op2);
+};
+
+} // namespace pi
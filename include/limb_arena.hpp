@@ -0,0 +1,36 @@
+#pragma once
+#include <cstddef>
+
+namespace pi {
+
+// GMP memory functions backed by per-thread size-class pools. Blocks of up
+// to MAX_POOLED_BYTES are rounded up to one of four classes per power of
+// two, and a freed block is cached on the freeing thread for the next
+// request of its class, so the millions of small P/Q/T buffers of binary
+// splitting cycle through thread-local free lists instead of contending
+// in malloc. A realloc that stays within its class keeps the block.
+// Larger blocks go straight to malloc, or to SwapSpace files once swap mode
+// is enabled.
+class LimbArena {
+public:
+  // 8192 limbs: the leaves and lower levels of binary splitting. Pooling
+  // larger blocks kept megabytes idle in the free lists and raised peak
+  // RSS.
+  static constexpr size_t MAX_POOLED_BYTES = (size_t)1 << 16;
+
+  // Freed blocks a thread keeps before handing further ones back to
+  // malloc; bounds the RSS the pools can hold on to
+  static constexpr size_t MAX_CACHED_BYTES = (size_t)8 << 20;
+
+  // Routes every GMP allocation through the pools. Must run before the
+  // first mpz is initialized: a block malloc'ed beforehand would be
+  // pooled under the wrong class when freed.
+  static void install();
+
+  // Buffers outside GMP that follow the same rules, such as the scratch
+  // of a large product; release takes the size that was allocated
+  static void *allocate(size_t bytes);
+  static void release(void *p, size_t bytes);
+};
+
+} // namespace pi
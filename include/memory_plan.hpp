@@ -0,0 +1,53 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+
+namespace pi {
+
+// Estimated peak memory of each phase of a run, and the task granularity
+// and parallel breadth that keep it under a cap. A phase's estimate adds
+// the integers live at its worst point, sized from the series bounds, to
+// the workspace of the products in flight there
+// (NTTMultiplier::workspace_bytes), so it follows the multiplication
+// policy of the team. In swap mode blocks that go to disk are not counted.
+class MemoryPlan {
+public:
+  // Team size of each phase, and the granularity of Step 1. Step 3 keeps
+  // the converter's task cutoff: a node below it is split serially inside
+  // one task and holds a few MB, so a smaller cutoff would save nothing
+  // worth planning; its peak is the root's integers and products, which
+  // only the team size changes.
+  int series_threads = 1;
+  int64_t series_task_terms = 0;
+  int merge_breadth = 0;
+  int evaluation_threads = 1;
+  int conversion_threads = 1;
+  int64_t convert_task_digits = 0; // fixed, BaseConverter::TASK_MIN_DIGITS
+
+  // Estimated peak bytes of Step 1 (series), Step 2 (square root,
+  // multiplication, division) and Step 3 (base conversion)
+  size_t step1 = 0, step2 = 0, step3 = 0;
+
+  size_t peak() const;
+  bool fits(size_t max_bytes) const {
+    return max_bytes == 0 || peak() <= max_bytes;
+  }
+
+  // The fastest configuration for up to `threads` threads whose phases
+  // each stay within max_bytes (0 means no cap). In Step 1 narrower merges
+  // come first, then smaller serial subtrees, then fewer threads; the other
+  // phases only have their team size to give. A phase nothing fits keeps
+  // its leanest configuration and fits() is false.
+  static MemoryPlan choose(int64_t digits, int threads, bool reduce_gcd,
+                           size_t max_bytes);
+
+  void print(std::ostream &os, size_t max_bytes) const;
+
+  // Plain bytes or a number with a binary K, M, G or T suffix ("200G")
+  static bool parse_size(const std::string &s, size_t &bytes);
+  static std::string format_size(size_t bytes);
+};
+
+} // namespace pi
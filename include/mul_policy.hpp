@@ -0,0 +1,88 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace pi {
+
+// Convolution used at the leaves of the parallel multiplication path.
+// NTT is the 32-bit triple-prime transform, with Toom-Cook above its
+// capacity; NTT64 the 62-bit-prime transform for every size; FFT the
+// floating-point multiplier in fft.hpp, which hands over to the NTT
+// whenever its error bound cannot be met. Auto picks per product from the
+// crossovers of the MulPolicy in use.
+enum class MulEngine { Auto, NTT, NTT64, FFT };
+
+// Dispatch decisions for one multiplication. Every entry point of
+// NTTMultiplier takes one, defaulting to MulPolicy::current(); a caller
+// that wants a different split (benchmarks, the tuner) passes its own.
+// Sizes are operand bits, compared against the larger operand unless
+// noted otherwise.
+struct MulPolicy {
+  static constexpr size_t NEVER = SIZE_MAX;
+
+  MulEngine engine = MulEngine::Auto;
+
+  // Below this (smaller operand) GMP's serial mpz_mul is used
+  size_t parallel_min_bits = 500000;
+
+  // Toom-Cook splits products from this size on even when one transform
+  // would hold them, to spread the work over more parallel leaves
+  size_t split_min_bits = NEVER;
+
+  // Auto uses the FP FFT for leaves inside [fft_min_bits, fft_max_bits]
+  size_t fft_min_bits = NEVER;
+  size_t fft_max_bits = 0;
+
+  // Auto switches from Toom-Cook over 32-bit leaves to the 64-bit NTT
+  size_t ntt64_min_bits = 200000000;
+
+  // Ways of every Toom-Cook split (2, 3 or 4); 0 picks per level from the
+  // product size and the team size
+  int split_ways = 0;
+
+  // Built-in crossovers for a team of the given size: the values measured
+  // on the development machine, and no parallel path for one thread.
+  static MulPolicy defaults(int threads);
+
+  // Policy of the profile loaded at startup for omp_get_max_threads()
+  static MulPolicy current();
+
+  // Copy of this policy with every leaf forced to one engine
+  MulPolicy with_engine(MulEngine e) const {
+    MulPolicy p = *this;
+    p.engine = e;
+    return p;
+  }
+};
+
+// Measured policies for several team sizes, persisted as one text line
+// per thread count. for_threads() picks the entry for the largest measured
+// team not above the requested one.
+class TuningProfile {
+public:
+  static constexpr const char *DEFAULT_PATH = "pi_calc.tune";
+
+  bool load(const std::string &path);
+  bool save(const std::string &path) const;
+
+  bool empty() const { return entries.empty(); }
+  void set(int threads, const MulPolicy &policy);
+  MulPolicy for_threads(int threads) const;
+
+  // Profile read once from DEFAULT_PATH (empty if absent); never modified
+  // afterwards, so every thread sees the same crossovers.
+  static const TuningProfile &startup();
+
+  // Benchmarks mpz_mul, the NTT, the FFT, Toom-Cook splits and the 64-bit
+  // NTT at 2, 4, ... threads up to omp_get_max_threads(), printing each
+  // measurement, and returns the crossovers found. A team of one always
+  // keeps to mpz_mul.
+  static TuningProfile tune();
+
+private:
+  std::vector<std::pair<int, MulPolicy>> entries; // sorted by threads
+};
+
+} // namespace pi
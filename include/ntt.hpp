@@ -1,32 +1,224 @@
 #pragma once
+#include "mul_policy.hpp"
 #include <cstdint>
 #include <gmp.h>
 #include <omp.h>
 #include <vector>
 
-
 namespace pi {
 
 class NTTMultiplier {
 public:
   // Primes for Triple-Prime NTT to ensure accuracy for huge numbers
-  static constexpr uint64_t MODS[] = {998244353, 1004535809, 469762049};
-  static constexpr uint64_t G = 3;
+  static constexpr uint32_t MODS[] = {998244353, 1004535809, 469762049};
+  static constexpr uint32_t G = 3;
+
+  // Operands are split into 32-bit coefficients. The smallest 2-adic order
+  // among MODS (1004535809 = 479 * 2^21 + 1) caps the transform length,
+  // and 2^21 * (2^32)^2 < MODS[0] * MODS[1] * MODS[2] keeps CRT exact.
+  static constexpr int COEFF_BITS = 32;
+  static constexpr int MAX_LOG_LEN = 21;
+
+  // Products beyond one 32-bit transform use three 62-bit primes whose
+  // 2-adic orders (50, 44, 43) allow lengths up to 2^43. Each coefficient
+  // is a whole 64-bit limb, and 2^43 * (2^64)^2 < MODS64[0] * MODS64[1] *
+  // MODS64[2] (> 2^185) keeps the 64-bit CRT exact at every length.
+  static constexpr uint64_t MODS64[] = {4601552919265804289ull,
+                                        4611105476287922177ull,
+                                        4610815205218189313ull};
+  static constexpr int MAX_LOG_LEN64 = 43;
 
+  using Engine = MulEngine;
+
+  // In-place transform of Montgomery-form values modulo one of MODS.
+  // Forward output is in bit-reversed order and the inverse expects it;
+  // the inverse is left unscaled (multiplied by a.size()).
+  static void ntt(std::vector<uint32_t> &a, bool invert, uint32_t mod);
   static void ntt(std::vector<uint64_t> &a, bool invert, uint64_t mod);
 
-  // Multiplies two mpz_t using parallel NTT
-  static void multiply(mpz_t rop, const mpz_t op1, const mpz_t op2);
-  
-  static bool use_hybrid; // Flag to toggle between Step 1 and Step 2 strategies
+  // Forward transforms of one operand, kept so that a factor shared by
+  // several products is transformed only once. When the NTT path does not
+  // apply the handle just refers to the mpz_t, which must outlive it.
+  class TransformedOperand {
+  public:
+    bool is_transformed() const { return n != 0; }
+
+  private:
+    friend class NTTMultiplier;
+    mpz_srcptr source = nullptr;
+    size_t bits = 0;         // size of |source|
+    size_t partner_bits = 0; // largest partner the length was sized for
+    size_t coeffs = 0;       // 32-bit coefficients of |source|
+    size_t n = 0;            // transform length, 0 if not transformed
+    int sign = 0;
+    std::vector<uint32_t> spectrum[3]; // one per MODS entry
+  };
+
+  // Multiplies two mpz_t using parallel NTT; op1 == op2 goes to square()
+  static void multiply(mpz_t rop, const mpz_t op1, const mpz_t op2,
+                       const MulPolicy &policy = MulPolicy::current());
+
+  // op^2 with a single forward transform per prime
+  static void square(mpz_t rop, const mpz_t op,
+                     const MulPolicy &policy = MulPolicy::current());
+
+  // Transforms op for products with partners of up to partner_bits bits
+  static TransformedOperand
+  transform(const mpz_t op, size_t partner_bits,
+            const MulPolicy &policy = MulPolicy::current());
+
+  // Products against a reusable transform. Partners larger than the
+  // handle was sized for, or handles of different lengths, fall back to
+  // the plain multiply.
+  static void multiply(mpz_t rop, const mpz_t op1,
+                       const TransformedOperand &op2,
+                       const MulPolicy &policy = MulPolicy::current());
+  static void multiply(mpz_t rop, const TransformedOperand &op1,
+                       const TransformedOperand &op2,
+                       const MulPolicy &policy = MulPolicy::current());
+
+  // Products of which only some bits are wanted. Each is one cyclic
+  // convolution just long enough that nothing wraps onto the wanted
+  // coefficients, and only those are carried into rop; products the policy
+  // leaves to mpz_mul or splits with Toom-Cook are formed whole and cut.
+  //
+  // floor(|op1 * op2| / 2^shift) with the sign of the product, or one less
+  // in magnitude: the carry from the discarded bits is not formed.
+  static void multiply_high(mpz_t rop, const mpz_t op1, const mpz_t op2,
+                            size_t shift,
+                            const MulPolicy &policy = MulPolicy::current());
+
+  // floor(op1 * op2 / 2^lo) mod 2^(hi - lo), or one less, for non-negative
+  // operands. The coefficients above hi wrap onto those below lo, so the
+  // transform covers max(hi, bits of the product - lo) rather than the
+  // whole product.
+  static void multiply_middle(mpz_t rop, const mpz_t op1, const mpz_t op2,
+                              size_t lo, size_t hi,
+                              const MulPolicy &policy = MulPolicy::current());
+
+  // Smallest K >= bits for which multiply_wrapped() runs one transform of
+  // K bits under this policy
+  static size_t wrap_bits(size_t bits,
+                          const MulPolicy &policy = MulPolicy::current());
+
+  // op1 * op2 mod (2^K - 1) in [0, 2^K - 1) for non-negative operands,
+  // with K from wrap_bits(): the wrapped convolution of GMP's
+  // mpn_mulmod_bnm1. Newton iterations whose product is known to lie
+  // near a power of two recover it from these K bits.
+  static void multiply_wrapped(mpz_t rop, const mpz_t op1, const mpz_t op2,
+                               size_t K,
+                               const MulPolicy &policy = MulPolicy::current());
+
+  // Bytes a product of this shape allocates besides its operands and
+  // result (transform buffers, Toom-Cook scratch, mpz_mul's scratch) when
+  // up to `threads` threads work on it, for memory planning. An upper
+  // estimate: every Toom-Cook leaf in flight is taken at full size.
+  static size_t workspace_bytes(size_t bits1, size_t bits2, int threads,
+                                const MulPolicy &policy = MulPolicy::current());
 
 private:
   static uint64_t power(uint64_t base, uint64_t exp, uint64_t mod);
   static uint64_t modInverse(uint64_t n, uint64_t mod);
 
+  // Power-of-two length holding the product of bits1- and bits2-bit values
+  static size_t transform_length(size_t bits1, size_t bits2);
+
+  // True when the product of op1 and op2 fits in one triple-prime transform
+  static bool fits_ntt(size_t bits1, size_t bits2);
+
+  // Same for the 64-bit-prime transform (limb coefficients)
+  static size_t transform_length64(size_t bits1, size_t bits2);
+  static bool fits_ntt64(size_t bits1, size_t bits2);
+
+  // True when a product of this shape should take the 32-bit NTT path
+  static bool use_ntt(size_t bits1, size_t bits2, const MulPolicy &policy);
+
+
+  // The routines below must run inside a parallel region so the per-prime
+  // work can be spawned as tasks.
+
+  // Triple-prime convolution of |op1| * |op2|, signed result in rop
+  static void ntt_multiply(mpz_t rop, const mpz_t op1, const mpz_t op2);
+
+  // Engine the policy picks for a product of this shape
+  static Engine leaf_engine(const MulPolicy &policy, size_t bits1,
+                            size_t bits2);
+
+  // True when Toom-Cook should split a product of this shape: it does not
+  // fit one transform of its engine, or the policy splits it anyway
+  static bool split_product(const MulPolicy &policy, size_t bits1,
+                            size_t bits2);
+
+  // One Toom-Cook leaf: mpz_mul below the threshold, else the engine's
+  // transform (op1 == op2 squares)
+  static void leaf_multiply(mpz_t rop, const mpz_t op1, const mpz_t op2,
+                            const MulPolicy &policy);
+
+  // rop = op1 * op2 through parallel Toom-Cook down to leaf_multiply;
+  // op1 == op2 squares
+  static void split_multiply(mpz_t rop, const mpz_t op1, const mpz_t op2,
+                             const MulPolicy &policy);
+
+  // Ways (2 = Karatsuba, 3 = Toom-3, 4 = Toom-4) to split a product of
+  // operands of up to n limbs, 0 when it is a leaf. The smallest way whose
+  // pieces are leaves, but at least team_ways so each level has work for
+  // the team.
+  static int toom_ways(size_t n, const MulPolicy &policy, int team_ways);
+
+  // Scratch limbs of a whole recursion on operands of up to n limbs
+  static size_t toom_scratch(size_t n, const MulPolicy &policy,
+                             int team_ways);
+
+  // {rp, an + bn} = {ap, an} * {bp, bn} for an, bn <= n; ap == bp with
+  // an == bn squares. Every split point works on limb views of the
+  // inputs; evaluations, point products and children use disjoint slices
+  // of scratch, laid out as toom_scratch(n) counted them.
+  static void toom_multiply(mp_limb_t *rp, const mp_limb_t *ap,
+                            mp_size_t an, const mp_limb_t *bp, mp_size_t bn,
+                            size_t n, mp_limb_t *scratch,
+                            const MulPolicy &policy, int team_ways);
+
+  // Squaring counterpart of ntt_multiply
+  static void ntt_square(mpz_t rop, const mpz_t op);
+
+  // Convolution of 64-bit limbs over MODS64 with a 64-bit Garner CRT;
+  // op1 == op2 transforms once.
+  static void ntt64_multiply(mpz_t rop, const mpz_t op1, const mpz_t op2);
+
+  // Words [from, to) of the length-n cyclic convolution of |op1| and
+  // |op2| (op1 == op2 squares), neither longer than n words: 32-bit
+  // coefficients, or whole limbs with `wide`. Nothing carries in from
+  // below `from`; carries out of `to` extend rop.
+  static void convolve_window(mpz_t rop, const mpz_t op1, const mpz_t op2,
+                              bool wide, size_t n, size_t from, size_t to);
+
+  // Word size, 32 or 64, of the one transform a partial product whose
+  // cyclic convolution spans `bits` uses
+  static int window_word(const MulPolicy &policy, size_t bits);
+
+  // Garner CRT of coefficients [from, to) of the three 32-bit-prime
+  // convolutions
+  static std::vector<__uint128_t> crt_coeffs(const std::vector<uint32_t> &r0,
+                                             const std::vector<uint32_t> &r1,
+                                             const std::vector<uint32_t> &r2,
+                                             size_t from, size_t to);
+
+  // Garner CRT of coefficients [from, to) of the three 62-bit-prime
+  // convolutions, carried into out[0, limbs) with limbs > to - from
+  static void crt_carry64(const uint64_t *r0, const uint64_t *r1,
+                          const uint64_t *r2, size_t from, size_t to,
+                          mp_limb_t *out, size_t limbs);
+
+  // Forward transforms of op at length n for all three primes
+  static void forward_all(TransformedOperand &t, const mpz_t op, size_t n);
+
+  // Pointwise products, inverse transforms and CRT back into rop
+  static void pointwise_multiply(mpz_t rop, const TransformedOperand &a,
+                                 const TransformedOperand &b);
+
   // Helpers to convert mpz_t to/from NTT buffers
-  static std::vector<uint64_t> mpz_to_vec(const mpz_t n, size_t &limbs);
-  static void vec_to_mpz(mpz_t rop, const std::vector<uint64_t> &vec);
+  static std::vector<uint32_t> mpz_to_vec(const mpz_t n, size_t &limbs);
+  static void vec_to_mpz(mpz_t rop, const std::vector<uint32_t> &vec);
 };
 
 } // namespace pi
@@ -0,0 +1,450 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace pi {
+
+// Butterfly implementation used by NTTKernel. AVX2 is chosen at runtime by
+// ntt_path() when the CPU supports it and the vector kernel reproduces the
+// scalar transform on a self-test input; otherwise Scalar.
+enum class NTTPath { Scalar, AVX2 };
+NTTPath ntt_path();
+
+namespace simd {
+bool cpu_has_avx2();
+
+// All routines work on fully reduced Montgomery values below mod < 2^30
+// and require count to be a multiple of 8.
+
+// count butterflies over x[0..count), y[0..count), twiddle w[j] per pair
+void dif_butterflies_avx2(uint32_t *x, uint32_t *y, const uint32_t *w,
+                          size_t count, uint32_t mod, uint32_t n_prime);
+void dit_butterflies_avx2(uint32_t *x, uint32_t *y, const uint32_t *w,
+                          size_t count, uint32_t mod, uint32_t n_prime);
+
+// Same, with one twiddle w for every pair (rows of a column transform)
+void dif_butterflies_bcast_avx2(uint32_t *x, uint32_t *y, uint32_t w,
+                                size_t count, uint32_t mod, uint32_t n_prime);
+void dit_butterflies_bcast_avx2(uint32_t *x, uint32_t *y, uint32_t w,
+                                size_t count, uint32_t mod, uint32_t n_prime);
+
+// The three shortest stages (len 8, 4, 2) on each 8-word block of a[0..n),
+// done in-register. w8 / w4 are the len-8 / len-4 twiddle tables.
+void dif_tail_avx2(uint32_t *a, size_t n, const uint32_t *w8,
+                   const uint32_t *w4, uint32_t mod, uint32_t n_prime);
+void dit_head_avx2(uint32_t *a, size_t n, const uint32_t *w8,
+                   const uint32_t *w4, uint32_t mod, uint32_t n_prime);
+
+// x[j] *= first8[j % 8] * step8^(j / 8)
+void scale_powers_avx2(uint32_t *x, size_t count, const uint32_t *first8,
+                       uint32_t step8, uint32_t mod, uint32_t n_prime);
+} // namespace simd
+
+// Arithmetic modulo a fixed prime Mod < 2^30 in Montgomery form (R = 2^32).
+// Every constant is derived at compile time from the template parameter.
+template <uint32_t Mod> struct MontgomeryField {
+  static_assert(Mod % 2 == 1 && Mod < (1u << 30), "Mod must be an odd 30-bit prime");
+
+  static constexpr uint32_t mod = Mod;
+
+  // -Mod^(-1) mod 2^32 by Newton iteration
+  static constexpr uint32_t neg_inv() {
+    uint32_t inv = Mod;
+    for (int i = 0; i < 5; ++i)
+      inv *= 2 - Mod * inv;
+    return ~inv + 1;
+  }
+  static constexpr uint32_t N_PRIME = neg_inv();
+  static constexpr uint32_t R2 =
+      (uint32_t)(((unsigned __int128)1 << 64) % Mod); // R^2 mod Mod
+
+  // t < Mod * 2^32  ->  t * R^(-1) mod Mod, fully reduced
+  static inline uint32_t reduce(uint64_t t) {
+    uint32_t m = (uint32_t)t * N_PRIME;
+    uint32_t r = (uint32_t)((t + (uint64_t)m * Mod) >> 32);
+    return r >= Mod ? r - Mod : r;
+  }
+  static inline uint32_t mul(uint32_t a, uint32_t b) {
+    return reduce((uint64_t)a * b);
+  }
+  static inline uint32_t add(uint32_t a, uint32_t b) {
+    uint32_t r = a + b;
+    return r >= Mod ? r - Mod : r;
+  }
+  static inline uint32_t sub(uint32_t a, uint32_t b) {
+    return a >= b ? a - b : a + Mod - b;
+  }
+
+  // Any x < 2^32 into Montgomery form, and back
+  static inline uint32_t to_mont(uint32_t x) { return mul(x, R2); }
+  static inline uint32_t from_mont(uint32_t x) { return reduce(x); }
+
+  static uint32_t pow(uint32_t base_mont, uint64_t exp) {
+    uint32_t res = to_mont(1);
+    while (exp > 0) {
+      if (exp & 1)
+        res = mul(res, base_mont);
+      base_mont = mul(base_mont, base_mont);
+      exp >>= 1;
+    }
+    return res;
+  }
+};
+
+// The same over a 62-bit prime with R = 2^64, for the 64-bit-coefficient
+// transforms. Mod < 2^62 keeps every intermediate sum below 2^64.
+template <uint64_t Mod> struct MontgomeryField64 {
+  static_assert(Mod % 2 == 1 && Mod < (1ull << 62), "Mod must be an odd 62-bit prime");
+
+  static constexpr uint64_t mod = Mod;
+
+  static constexpr uint64_t neg_inv() {
+    uint64_t inv = Mod;
+    for (int i = 0; i < 6; ++i)
+      inv *= 2 - Mod * inv;
+    return ~inv + 1;
+  }
+  static constexpr uint64_t N_PRIME = neg_inv();
+  static constexpr uint64_t R1 = (~0ull % Mod + 1) % Mod; // R mod Mod
+  static constexpr uint64_t R2 =
+      (uint64_t)((unsigned __int128)R1 * R1 % Mod); // R^2 mod Mod
+
+  // t < Mod * 2^64  ->  t * R^(-1) mod Mod, fully reduced
+  static inline uint64_t reduce(unsigned __int128 t) {
+    uint64_t m = (uint64_t)t * N_PRIME;
+    uint64_t r =
+        (uint64_t)((t + (unsigned __int128)m * Mod) >> 64);
+    return r >= Mod ? r - Mod : r;
+  }
+  static inline uint64_t mul(uint64_t a, uint64_t b) {
+    return reduce((unsigned __int128)a * b);
+  }
+  static inline uint64_t add(uint64_t a, uint64_t b) {
+    uint64_t r = a + b;
+    return r >= Mod ? r - Mod : r;
+  }
+  static inline uint64_t sub(uint64_t a, uint64_t b) {
+    return a >= b ? a - b : a + Mod - b;
+  }
+
+  // Any x < 2^64 into Montgomery form, and back
+  static inline uint64_t to_mont(uint64_t x) { return mul(x, R2); }
+  static inline uint64_t from_mont(uint64_t x) { return reduce(x); }
+
+  static uint64_t pow(uint64_t base_mont, uint64_t exp) {
+    uint64_t res = to_mont(1);
+    while (exp > 0) {
+      if (exp & 1)
+        res = mul(res, base_mont);
+      base_mont = mul(base_mont, base_mont);
+      exp >>= 1;
+    }
+    return res;
+  }
+};
+
+// Field type for a prime of the given word type
+template <class Word> struct MontgomeryFor;
+template <> struct MontgomeryFor<uint32_t> {
+  template <uint32_t Mod> using type = MontgomeryField<Mod>;
+};
+template <> struct MontgomeryFor<uint64_t> {
+  template <uint64_t Mod> using type = MontgomeryField64<Mod>;
+};
+
+// Radix-2 NTT over MontgomeryField<Mod> (uint32_t Mod) or
+// MontgomeryField64<Mod> (uint64_t Mod) with primitive root G.
+// forward() is decimation-in-frequency (natural order in, bit-reversed out)
+// and inverse() is decimation-in-time (bit-reversed in, natural order out),
+// so a convolution never needs a bit-reversal permutation. The AVX2 path
+// only exists for 32-bit words; 64-bit kernels always run scalar.
+template <auto Mod, uint32_t G = 3> class NTTKernel {
+public:
+  using word = decltype(Mod);
+  using F = typename MontgomeryFor<word>::template type<Mod>;
+
+  static constexpr int max_log_len() {
+    int k = 0;
+    while (((Mod - 1) >> k) % 2 == 0)
+      ++k;
+    return k;
+  }
+
+  static void forward(word *a, size_t n, NTTPath path = ntt_path()) {
+    if (!VEC)
+      path = NTTPath::Scalar;
+    if (n >= FOUR_STEP_MIN)
+      four_step_forward(a, n, path);
+    else
+      radix2_forward(a, n, path);
+  }
+
+  // Leaves the result multiplied by n; the caller folds 1/n into its own
+  // output conversion (see scale_factor()).
+  static void inverse(word *a, size_t n, NTTPath path = ntt_path()) {
+    if (!VEC)
+      path = NTTPath::Scalar;
+    if (n >= FOUR_STEP_MIN)
+      four_step_inverse(a, n, path);
+    else
+      radix2_inverse(a, n, path);
+  }
+
+  // n^(-1) as a plain (non-Montgomery) value: mul(x_mont, scale_factor(n))
+  // yields x / n already converted out of Montgomery form.
+  static word scale_factor(size_t n) {
+    word n_mont = F::to_mont((word)(n % Mod));
+    return F::from_mont(F::pow(n_mont, Mod - 2));
+  }
+
+private:
+  static constexpr bool VEC = sizeof(word) == sizeof(uint32_t);
+
+  // From this length on the array no longer fits in L2 and every radix-2
+  // stage would stream it from DRAM, so Bailey's four-step split is used.
+  // Shorter transforms run serially; their callers supply the parallelism.
+  static constexpr size_t FOUR_STEP_MIN = (size_t)1 << 16;
+  static constexpr size_t COLUMN_TILE_BYTES = 131072;
+
+  static void radix2_forward(word *a, size_t n, NTTPath path) {
+    const bool vec_tail = path == NTTPath::AVX2 && n >= 8;
+    for (size_t len = n; len >= (vec_tail ? 16 : 2); len >>= 1) {
+      const word *w = twiddles(len, false);
+      for (size_t blk = 0; blk < n; blk += len)
+        butterflies<true>(a + blk, a + blk + len / 2, w, len / 2, path);
+    }
+    if constexpr (VEC) {
+      if (vec_tail)
+        simd::dif_tail_avx2(a, n, twiddles(8, false), twiddles(4, false),
+                            Mod, F::N_PRIME);
+    }
+  }
+
+  static void radix2_inverse(word *a, size_t n, NTTPath path) {
+    size_t len = 2;
+    if constexpr (VEC) {
+      if (path == NTTPath::AVX2 && n >= 8) {
+        simd::dit_head_avx2(a, n, twiddles(8, true), twiddles(4, true), Mod,
+                            F::N_PRIME);
+        len = 16;
+      }
+    }
+    for (; len <= n; len <<= 1) {
+      const word *w = twiddles(len, true);
+      for (size_t blk = 0; blk < n; blk += len)
+        butterflies<false>(a + blk, a + blk + len / 2, w, len / 2, path);
+    }
+  }
+
+  static size_t bit_reverse(size_t x, int bits) {
+    size_t r = 0;
+    for (int i = 0; i < bits; ++i, x >>= 1)
+      r = (r << 1) | (x & 1);
+    return r;
+  }
+
+  static int four_step_log_rows(size_t n) {
+    int log_r = 0;
+    while (((size_t)1 << (2 * (log_r + 1))) <= n)
+      ++log_r;
+    return log_r;
+  }
+
+  // w_n^e for the transform of length n (Montgomery form)
+  static word root_power(size_t n, bool invert, size_t e) {
+    int log = 0;
+    while (((size_t)1 << log) < n)
+      ++log;
+    word root = F::pow(F::to_mont(G), (Mod - 1) >> log);
+    if (invert)
+      root = F::pow(root, Mod - 2);
+    return F::pow(root, e);
+  }
+
+  // Views a as an R x C row-major matrix (n = R * C, R <= C), with
+  // j = j1 * C + j2 and k = k1 + R * k2:
+  //   1. length-R transforms down every column, a tile of columns at a time,
+  //   2. scale element (k1, j2) by w_n^(j2 * k1),
+  //   3. length-C transforms along each row.
+  // Sub-transforms are bit-reversed, so position p * C + q holds
+  // X[rev_R(p) + R * rev_C(q)]; four_step_inverse undoes exactly this.
+  // Row scales are single powers of w_n rather than a table of n/2
+  // twiddles, which at 64-bit lengths of 2^30 would cost gigabytes.
+  static void four_step_forward(word *a, size_t n, NTTPath path) {
+    const int log_r = four_step_log_rows(n);
+    const size_t R = (size_t)1 << log_r, C = n / R;
+
+    transform_columns<true>(a, R, C, path);
+
+#pragma omp taskloop grainsize(std::max<size_t>(1, 16384 / C))
+    for (size_t p = 0; p < R; ++p) {
+      word *row = a + p * C;
+      scale_row(row, C, root_power(n, false, bit_reverse(p, log_r)), path);
+      radix2_forward(row, C, path);
+    }
+  }
+
+  static void four_step_inverse(word *a, size_t n, NTTPath path) {
+    const int log_r = four_step_log_rows(n);
+    const size_t R = (size_t)1 << log_r, C = n / R;
+
+#pragma omp taskloop grainsize(std::max<size_t>(1, 16384 / C))
+    for (size_t p = 0; p < R; ++p) {
+      word *row = a + p * C;
+      radix2_inverse(row, C, path);
+      scale_row(row, C, root_power(n, true, bit_reverse(p, log_r)), path);
+    }
+
+    transform_columns<false>(a, R, C, path);
+  }
+
+  // row[j] *= step^j
+  static void scale_row(word *row, size_t C, word step, NTTPath path) {
+    word cur = F::to_mont(1);
+    if (step == cur)
+      return;
+    if constexpr (VEC) {
+      if (path == NTTPath::AVX2 && C % 8 == 0) {
+        uint32_t first8[8];
+        for (int j = 0; j < 8; ++j) {
+          first8[j] = cur;
+          cur = F::mul(cur, step);
+        }
+        simd::scale_powers_avx2(row, C, first8, cur, Mod, F::N_PRIME);
+        return;
+      }
+    }
+    for (size_t j = 0; j < C; ++j) {
+      row[j] = F::mul(row[j], cur);
+      cur = F::mul(cur, step);
+    }
+  }
+
+  // A column transform is a radix-2 transform whose elements are whole
+  // rows, so a tile of adjacent columns is copied into a contiguous buffer
+  // (avoiding the cache-set aliasing of the power-of-two row stride) and
+  // every butterfly becomes a vector operation across the tile width.
+  template <bool Forward>
+  static void transform_columns(word *a, size_t R, size_t C, NTTPath path) {
+    const size_t width = std::min(
+        C, std::max<size_t>(8, COLUMN_TILE_BYTES / sizeof(word) / R));
+#pragma omp taskloop grainsize(1)
+    for (size_t c0 = 0; c0 < C; c0 += width) {
+      thread_local std::vector<word> buf;
+      buf.resize(R * width);
+      for (size_t r = 0; r < R; ++r)
+        std::copy(a + r * C + c0, a + r * C + c0 + width,
+                  buf.data() + r * width);
+
+      if (Forward) {
+        for (size_t len = R; len >= 2; len >>= 1)
+          column_stage<true>(buf.data(), R, width, len, path);
+      } else {
+        for (size_t len = 2; len <= R; len <<= 1)
+          column_stage<false>(buf.data(), R, width, len, path);
+      }
+
+      for (size_t r = 0; r < R; ++r)
+        std::copy(buf.data() + r * width, buf.data() + (r + 1) * width,
+                  a + r * C + c0);
+    }
+  }
+
+  template <bool DIF>
+  static void column_stage(word *buf, size_t R, size_t width, size_t len,
+                           NTTPath path) {
+    const size_t half = len / 2;
+    const word *w = twiddles(len, !DIF);
+    for (size_t blk = 0; blk < R; blk += len) {
+      for (size_t j = 0; j < half; ++j) {
+        word *x = buf + (blk + j) * width;
+        word *y = x + half * width;
+        if constexpr (VEC) {
+          if (path == NTTPath::AVX2 && width % 8 == 0) {
+            if (DIF)
+              simd::dif_butterflies_bcast_avx2(x, y, w[j], width, Mod,
+                                               F::N_PRIME);
+            else
+              simd::dit_butterflies_bcast_avx2(x, y, w[j], width, Mod,
+                                               F::N_PRIME);
+            continue;
+          }
+        }
+        for (size_t t = 0; t < width; ++t)
+          butterfly<DIF>(x[t], y[t], w[j]);
+      }
+    }
+  }
+
+  template <bool DIF>
+  static inline void butterfly(word &x, word &y, word w) {
+    word u = x, v = y;
+    if (DIF) {
+      x = F::add(u, v);
+      y = F::mul(F::sub(u, v), w);
+    } else {
+      v = F::mul(v, w);
+      x = F::add(u, v);
+      y = F::sub(u, v);
+    }
+  }
+
+  template <bool DIF>
+  static inline void butterflies(word *x, word *y, const word *w,
+                                 size_t count, NTTPath path) {
+    if constexpr (VEC) {
+      if (path == NTTPath::AVX2 && count % 8 == 0) {
+        if (DIF)
+          simd::dif_butterflies_avx2(x, y, w, count, Mod, F::N_PRIME);
+        else
+          simd::dit_butterflies_avx2(x, y, w, count, Mod, F::N_PRIME);
+        return;
+      }
+    }
+    for (size_t j = 0; j < count; ++j)
+      butterfly<DIF>(x[j], y[j], w[j]);
+  }
+
+  // w_len^j (Montgomery form) for j < len/2, built once per stage length
+  // and direction, then shared by every later transform.
+  static const word *twiddles(size_t len, bool invert) {
+    int log = 0;
+    while (((size_t)1 << log) < len)
+      ++log;
+    std::atomic<word *> &slot = table()[invert][log];
+    word *w = slot.load(std::memory_order_acquire);
+    if (w)
+      return w;
+
+    std::lock_guard<std::mutex> lock(table_mutex());
+    w = slot.load(std::memory_order_relaxed);
+    if (w)
+      return w;
+
+    size_t half = len / 2;
+    w = new word[std::max<size_t>(half, 1)];
+    word root = root_power(len, invert, 1);
+    word cur = F::to_mont(1);
+    for (size_t j = 0; j < half; ++j) {
+      w[j] = cur;
+      cur = F::mul(cur, root);
+    }
+    slot.store(w, std::memory_order_release);
+    return w;
+  }
+
+  static std::atomic<word *> (&table())[2][64] {
+    static std::atomic<word *> t[2][64] = {};
+    return t;
+  }
+  static std::mutex &table_mutex() {
+    static std::mutex m;
+    return m;
+  }
+};
+
+} // namespace pi
@@ -0,0 +1,42 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace pi {
+
+// Prints "\r<label>: done / total <unit>" from a background thread while a
+// computation runs, polling read() at a fixed interval, so the workers
+// never touch stdout or a lock to report progress. The destructor stops
+// the sampler and prints the final count.
+class ProgressSampler {
+public:
+  ProgressSampler(std::function<int64_t()> read, int64_t total,
+                  std::string label, std::string unit,
+                  std::chrono::milliseconds interval =
+                      std::chrono::milliseconds(500));
+  ~ProgressSampler();
+
+  ProgressSampler(const ProgressSampler &) = delete;
+  ProgressSampler &operator=(const ProgressSampler &) = delete;
+
+private:
+  void print(int64_t done) const;
+  void run();
+
+  std::function<int64_t()> read;
+  int64_t total;
+  std::string label, unit;
+  std::chrono::milliseconds interval;
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool stopping = false;
+  std::thread worker;
+};
+
+} // namespace pi
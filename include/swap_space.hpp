@@ -0,0 +1,47 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+namespace pi {
+
+// File-backed storage for the largest blocks of a computation. Once
+// enabled, every block of at least min_bytes() is a shared mapping of its
+// own unlinked file in the swap directory, so its pages are written back
+// to disk and dropped under memory pressure instead of exhausting RAM and
+// swap. The kernel streams them back in as the products, divisions and
+// conversions walk their limbs, which they do front to back. Smaller
+// blocks, and the transform buffers of the multipliers, stay in RAM.
+class SwapSpace {
+public:
+  // Blocks below this stay in RAM by default: the leaves and lower levels
+  // of every recursion, whose reuse a round trip to disk would defeat
+  static constexpr size_t DEFAULT_MIN_BYTES = (size_t)64 << 20;
+
+  // Directs blocks of at least min_bytes to files under dir. Must run
+  // before the first such block is allocated: blocks are told apart by
+  // size alone when freed. Returns false, printing the reason, when dir is
+  // not a writable directory or the platform lacks file mappings.
+  static bool enable(const std::string &dir,
+                     size_t min_bytes = DEFAULT_MIN_BYTES);
+
+  static bool enabled() { return threshold != 0; }
+
+  // True for the block sizes that live in swap files
+  static bool holds(size_t bytes) {
+    return threshold != 0 && bytes >= threshold;
+  }
+
+  static size_t min_bytes() { return threshold; }
+
+  // Blocks for which holds(bytes) is true. Disk space is reserved up
+  // front; running out of it aborts like a failed malloc in GMP.
+  static void *allocate(size_t bytes);
+  static void *reallocate(void *p, size_t old_bytes, size_t new_bytes);
+  static void release(void *p, size_t bytes);
+
+private:
+  static size_t threshold;
+  static std::string directory;
+};
+
+} // namespace pi
@@ -2,6 +2,7 @@
 #define VALIDATOR_HPP
 
 #include <cstdint>
+#include <gmp.h>
 #include <string>
 #include <vector>
 #include <utility>
@@ -18,6 +19,15 @@ struct ValidationResult {
   double chi_square;                 // Statistical uniformity check
 };
 
+// One window of hexadecimal digits of a computed pi, checked against the
+// same digits extracted on their own by Bellard's formula
+struct HexCheck {
+  int64_t position;     // hex digits after the point ahead of the window
+  std::string expected; // the digits the formula is certain of
+  std::string actual;   // the same digits of the computed value
+  bool passed;
+};
+
 class PiValidator {
 public:
   // Validate computed Pi decimal string against known benchmarks and statistics
@@ -30,6 +40,18 @@ public:
       double user_time, double kernel_time, int threads,
       const std::vector<std::pair<double, std::string>> &event_log);
 
+  // Hex digits position+1, position+2, ... of pi after the point, without
+  // any of those before them: the terms of Bellard's formula are summed
+  // mod 1 in parallel as 64-bit fractions. Writes 16 digits to out and
+  // returns how many of them the rounding of the terms cannot have
+  // changed, typically 8 or more up to position 10^9.
+  static int bbp_hex_digits(int64_t position, char *out);
+
+  // Compares y / 2^bits, a computed pi, with bbp_hex_digits at windows
+  // ending at its hex digit hex_digits, at half and at a quarter of it
+  static std::vector<HexCheck> check_hex(const mpz_t y, size_t bits,
+                                         int64_t hex_digits);
+
 private:
   static uint64_t calculate_hash(const char *str, int64_t len);
 };
@@ -42,13 +42,163 @@ struct PowerPair {
   ~PowerPair() { mpz_clear(val); }
 };
 
-void BaseConverter::collect_powers(int64_t digits, std::vector<int64_t> &needed) {
-  if (digits <= 16384)
+// Where the leaves of the remainder tree put their digits: ASCII text, or
+// packed words when words is set
+struct DigitSink {
+  char *text = nullptr;
+  uint64_t *words = nullptr;
+};
+
+namespace {
+
+// Pieces of at most this many digits are written out a word at a time.
+// The leaf loops are quadratic, so they stay short; the splits above them
+// are cheap at this size.
+constexpr int64_t LEAF_DIGITS = 1024;
+
+// Guard bits every fraction of the scaled remainder tree carries beyond
+// its digits. Each level adds at most three units of 2^-GUARD_BITS, in
+// units of the node's last digit, to the error of the leaves below.
+constexpr size_t GUARD_BITS = 64;
+
+// A leaf is trusted when the bits of y * 10^digits below the point are
+// at least 2^-AMBIGUOUS_BITS away from an integer
+constexpr size_t AMBIGUOUS_BITS = 48;
+
+size_t fraction_bits(int64_t digits) {
+  return (size_t)(digits * 3.32192809488736235) + 1 + GUARD_BITS;
+}
+
+// Leaves are converted a machine word at a time, 19 digits per word
+constexpr int WORD_DIGITS = 19;
+constexpr uint64_t WORD_BASE = 10000000000000000000ull;
+
+// Limbs of a leaf's fraction (or integer), held on the stack
+constexpr size_t LEAF_LIMBS =
+    (LEAF_DIGITS * 3.32192809488736235 + 1 + GUARD_BITS) / GMP_NUMB_BITS + 2;
+
+uint64_t pow10_u64(int k) {
+  uint64_t p = 1;
+  while (k-- > 0)
+    p *= 10;
+  return p;
+}
+
+// The 8 digits of x < 10^8 as ASCII in memory order. Two four-digit
+// groups in 32-bit lanes become four pairs in 16-bit lanes and then eight
+// digits in bytes; each step divides every lane at once by a reciprocal
+// multiplication that is exact in range.
+uint64_t eight_digits(uint32_t x) {
+  const uint64_t fours = (x / 10000) | (uint64_t)(x % 10000) << 32;
+  const uint64_t hundreds = ((fours * 10486) >> 20) & 0x0000007F0000007Full;
+  const uint64_t pairs = hundreds | (fours - 100 * hundreds) << 16;
+  const uint64_t tens = ((pairs * 103) >> 10) & 0x000F000F000F000Full;
+  const uint64_t digits = tens | (pairs - 10 * tens) << 8;
+  return digits + 0x3030303030303030ull;
+}
+
+// The 19 digits of v < 10^19, zero-padded, without branches
+void write_word(uint64_t v, char *out) {
+  const uint32_t top = (uint32_t)(v / 10000000000000000ull);
+  const uint64_t rest = v % 10000000000000000ull;
+  out[0] = (char)('0' + top / 100);
+  out[1] = (char)('0' + top / 10 % 10);
+  out[2] = (char)('0' + top % 10);
+  const uint64_t hi = eight_digits((uint32_t)(rest / 100000000));
+  const uint64_t lo = eight_digits((uint32_t)(rest % 100000000));
+  memcpy(out + 3, &hi, 8);
+  memcpy(out + 11, &lo, 8);
+}
+
+// The last k <= 19 digits of v
+void write_tail(uint64_t v, int k, char *out) {
+  char word[WORD_DIGITS];
+  write_word(v, word);
+  memcpy(out, word + WORD_DIGITS - k, k);
+}
+
+// The digits of 0 <= n < 10^digits, zero-padded on the left: the
+// remainders of repeated division by 10^19, last word first
+void write_integer_leaf(const mpz_t n, int64_t digits, char *out) {
+  mp_limb_t u[LEAF_LIMBS];
+  mp_size_t size = (mp_size_t)mpz_size(n);
+  std::copy(mpz_limbs_read(n), mpz_limbs_read(n) + size, u);
+  for (int64_t left = digits; left > 0;) {
+    const int k = (int)std::min<int64_t>(WORD_DIGITS, left);
+    const uint64_t word =
+        size ? mpn_divrem_1(u, 0, u, size, pow10_u64(k)) : 0;
+    while (size > 0 && u[size - 1] == 0)
+      --size;
+    left -= k;
+    write_tail(word, k, out + left);
+  }
+}
+
+// Where the leaf starting at digit `at` writes. Every packed leaf but the
+// last starts and ends on a word boundary.
+char *leaf_text(const DigitSink &sink, int64_t at) {
+  return sink.text ? sink.text + at : nullptr;
+}
+uint64_t *leaf_words(const DigitSink &sink, int64_t at) {
+  return sink.words ? sink.words + at / WORD_DIGITS : nullptr;
+}
+
+// Digits of the high part of a remainder-tree node: about half, rounded
+// down to whole words so that packed leaves start on word boundaries
+int64_t high_digits(int64_t digits) {
+  return std::max<int64_t>(WORD_DIGITS, digits / 2 / WORD_DIGITS * WORD_DIGITS);
+}
+
+// The first `digits` digits of the fraction y / 2^b, first word first,
+// as text at out or, when words is set, as packed words: each
+// multiplication by 10^19 carries the next word out of the top limb.
+// Limbs too low to reach the remaining digits are dropped as it goes.
+// True when the fraction left over is within 2^-AMBIGUOUS_BITS of 0 or 1.
+bool write_fraction_leaf(const mpz_t y, size_t b, int64_t digits, char *out,
+                         uint64_t *words) {
+  mp_limb_t f[LEAF_LIMBS];
+  const size_t limbs = (b + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS;
+  const size_t size = mpz_size(y);
+  std::copy(mpz_limbs_read(y), mpz_limbs_read(y) + size, f);
+  std::fill(f + size, f + limbs, 0);
+  if (const unsigned shift = (unsigned)(limbs * GMP_NUMB_BITS - b))
+    mpn_lshift(f, f, limbs, shift);
+
+  size_t low = 0;
+  for (int64_t left = digits; left > 0;) {
+    const int k = (int)std::min<int64_t>(WORD_DIGITS, left);
+    const uint64_t word = mpn_mul_1(f + low, f + low, limbs - low,
+                                    k == WORD_DIGITS ? WORD_BASE
+                                                     : pow10_u64(k));
+    if (words) {
+      *words++ = word * pow10_u64(WORD_DIGITS - k);
+    } else {
+      if (k == WORD_DIGITS)
+        write_word(word, out);
+      else
+        write_tail(word, k, out);
+      out += k;
+    }
+    left -= k;
+    const size_t keep =
+        (size_t)(left * 3.32192809488736235 + GUARD_BITS) / GMP_NUMB_BITS + 2;
+    if (limbs - low > keep)
+      low = limbs - keep;
+  }
+  const mp_limb_t below = f[limbs - 1] >> (GMP_NUMB_BITS - AMBIGUOUS_BITS);
+  return below == 0 || below == ((mp_limb_t)1 << AMBIGUOUS_BITS) - 1;
+}
+
+} // namespace
+
+void BaseConverter::collect_powers(int64_t digits, bool scaled,
+                                   std::vector<int64_t> &needed) {
+  if (digits <= LEAF_DIGITS)
     return;
-  int64_t half = digits / 2;
+  int64_t half = scaled ? high_digits(digits) : digits / 2;
   needed.push_back(half);
-  collect_powers(digits - half, needed);
-  collect_powers(half, needed);
+  collect_powers(digits - half, scaled, needed);
+  collect_powers(half, scaled, needed);
 }
 
 static const mpz_t *get_power(const std::vector<PowerPair> &powers, int64_t half) {
@@ -66,29 +216,25 @@ static const mpz_t *get_power(const std::vector<PowerPair> &powers, int64_t half
 }
 
 void BaseConverter::recursive_split(mpz_t n, int64_t digits, char *out,
-                                    const std::vector<mpz_t *> &powers,
-                                    int level) {
+                                    const std::vector<PowerPair> &powers,
+                                    int64_t task_min_digits) {
   // Use a much higher threshold for tasking to avoid memory bloat
   // 1 million digits is a good balance between parallelism and memory safety
-  if (digits < 1000000) {
-    if (digits <= 16384) {
-      char *s = mpz_get_str(NULL, 10, n);
-      size_t len = strlen(s);
-      if ((int64_t)len < digits) memset(out, '0', digits - len);
-      memcpy(out + (digits > (int64_t)len ? digits - len : 0), s, len);
-      void (*freefunc)(void *, size_t);
-      mp_get_memory_functions(NULL, NULL, &freefunc);
-      freefunc(s, len + 1);
+  if (digits < task_min_digits) {
+    if (digits <= LEAF_DIGITS) {
+      write_integer_leaf(n, digits, out);
       return;
     }
 
     int64_t half = digits / 2;
+    const mpz_t *power = get_power(powers, half);
     mpz_t high, low;
     mpz_init(high);
     mpz_init(low);
-    mpz_tdiv_qr(high, low, n, *powers[level]);
-    recursive_split(high, digits - half, out, powers, level + 1);
-    recursive_split(low, half, out + (digits - half), powers, level + 1);
+    mpz_tdiv_qr(high, low, n, *power);
+    recursive_split(high, digits - half, out, powers, task_min_digits);
+    recursive_split(low, half, out + (digits - half), powers,
+                    task_min_digits);
     mpz_clear(high);
     mpz_clear(low);
     return;
@@ -99,43 +245,108 @@ void BaseConverter::recursive_split(mpz_t n, int64_t digits, char *out,
   mpz_t high, low;
   mpz_init(high);
   mpz_init(low);
-  mpz_tdiv_qr(high, low, n, *powers[level]);
+  mpz_tdiv_qr(high, low, n, *power);
 
-#pragma omp task shared(out, powers, high) firstprivate(digits, half)
+#pragma omp task shared(out, powers, high) firstprivate(digits, half, task_min_digits)
   {
+    // Takes over the limbs of high rather than copying them
     mpz_t h;
-    mpz_init_set(h, high);
-    recursive_split(h, digits - half, out, powers, level + 1);
+    mpz_init(h);
+    mpz_swap(h, high);
+    recursive_split(h, digits - half, out, powers, task_min_digits);
     mpz_clear(h);
-    mpz_clear(high); // Clear the firstprivate copy
+    mpz_clear(high);
   }
 
-#pragma omp task shared(out, powers, low) firstprivate(digits, half)
+#pragma omp task shared(out, powers, low) firstprivate(digits, half, task_min_digits)
   {
     mpz_t l;
-    mpz_init_set(l, low);
-    recursive_split(l, half, out + (digits - half), powers, level + 1);
+    mpz_init(l);
+    mpz_swap(l, low);
+    recursive_split(l, half, out + (digits - half), powers, task_min_digits);
     mpz_clear(l);
-    mpz_clear(low); // Clear the firstprivate copy
+    mpz_clear(low);
   }
 
 #pragma omp taskwait
 }
 
-void BaseConverter::parallel_to_str(mpz_t n, int64_t total_digits,
-                                    char *out_buf) {
+void BaseConverter::scaled_split(mpz_t y, int64_t digits, int64_t at,
+                                 const DigitSink &sink,
+                                 const std::vector<PowerPair> &powers,
+                                 int64_t task_min_digits,
+                                 std::atomic<bool> &ambiguous) {
+  // y / 2^b is the fraction whose first `digits` digits belong here
+  const size_t b = fraction_bits(digits);
+  if (digits <= LEAF_DIGITS) {
+    // Truncation may have moved the value across a digit boundary only
+    // when the bits below the last digit are all zeros or all ones
+    if (write_fraction_leaf(y, b, digits, leaf_text(sink, at),
+                            leaf_words(sink, at)))
+      ambiguous = true;
+    return;
+  }
+
+  // The first half digits are the leading bits of y; the rest are the
+  // fraction of y * 10^half, of which only its own leading bits are formed
+  const int64_t half = high_digits(digits);
+  const size_t b_high = fraction_bits(half);
+  const size_t b_low = fraction_bits(digits - half);
+  mpz_t high, low;
+  mpz_init(high);
+  mpz_init(low);
+  NTTMultiplier::multiply_middle(low, y, *get_power(powers, half), b - b_low,
+                                 b);
+  mpz_tdiv_q_2exp(high, y, b - b_high);
+  mpz_realloc2(y, 0);
+
+  if (digits < task_min_digits) {
+    scaled_split(high, half, at, sink, powers, task_min_digits, ambiguous);
+    scaled_split(low, digits - half, at + half, sink, powers,
+                 task_min_digits, ambiguous);
+    mpz_clear(high);
+    mpz_clear(low);
+    return;
+  }
+
+#pragma omp task shared(sink, powers, high, ambiguous) firstprivate(at, half, task_min_digits)
+  {
+    mpz_t h;
+    mpz_init(h);
+    mpz_swap(h, high);
+    scaled_split(h, half, at, sink, powers, task_min_digits, ambiguous);
+    mpz_clear(h);
+    mpz_clear(high);
+  }
+
+#pragma omp task shared(sink, powers, low, ambiguous) firstprivate(at, digits, half, task_min_digits)
+  {
+    mpz_t l;
+    mpz_init(l);
+    mpz_swap(l, low);
+    scaled_split(l, digits - half, at + half, sink, powers, task_min_digits,
+                 ambiguous);
+    mpz_clear(l);
+    mpz_clear(low);
+  }
+
+#pragma omp taskwait
+}
+
+void BaseConverter::build_powers(int64_t total_digits, bool scaled,
+                                 std::vector<PowerPair> &powers) {
   std::vector<int64_t> needed;
-  collect_powers(total_digits, needed);
+  collect_powers(total_digits, scaled, needed);
   std::sort(needed.begin(), needed.end());
   needed.erase(std::unique(needed.begin(), needed.end()), needed.end());
 
-  std::vector<PowerPair> powers(needed.size());
+  powers.resize(needed.size());
   for (size_t i = 0; i < needed.size(); ++i) {
     powers[i].digits = needed[i];
     bool computed = false;
     for (int j = (int)i - 1; j >= 0; --j) {
       if (powers[j].digits * 2 == powers[i].digits) {
-        NTTMultiplier::multiply(powers[i].val, powers[j].val, powers[j].val);
+        NTTMultiplier::square(powers[i].val, powers[j].val);
         computed = true;
         break;
       } else if (powers[j].digits < powers[i].digits) {
@@ -156,14 +367,103 @@ void BaseConverter::parallel_to_str(mpz_t n, int64_t total_digits,
       BigInt::parallel_pow_ui(powers[i].val, 10, powers[i].digits);
     }
   }
+}
+
+void BaseConverter::parallel_to_str(mpz_t n, int64_t total_digits,
+                                    char *out_buf, int64_t task_min_digits) {
+  std::vector<PowerPair> powers;
+  build_powers(total_digits, false, powers);
+
+#pragma omp parallel
+  {
+#pragma omp single
+    recursive_split(n, total_digits, out_buf, powers, task_min_digits);
+  }
+}
+
+bool BaseConverter::fraction_to_str(const mpz_t y, size_t bits,
+                                    int64_t total_digits, char *out_buf,
+                                    int64_t task_min_digits) {
+  DigitSink sink;
+  sink.text = out_buf;
+  return fraction_to_sink(y, bits, total_digits, sink, task_min_digits);
+}
+
+bool BaseConverter::fraction_to_words(const mpz_t y, size_t bits,
+                                      int64_t total_digits, uint64_t *words,
+                                      int64_t task_min_digits) {
+  DigitSink sink;
+  sink.words = words;
+  return fraction_to_sink(y, bits, total_digits, sink, task_min_digits);
+}
+
+bool BaseConverter::fraction_to_sink(const mpz_t y, size_t bits,
+                                     int64_t total_digits,
+                                     const DigitSink &sink,
+                                     int64_t task_min_digits) {
+  std::vector<PowerPair> powers;
+  build_powers(total_digits, true, powers);
+
+  // The root keeps the fraction bits its digits need and drops any
+  // integer part
+  const size_t b = fraction_bits(total_digits);
+  mpz_t root;
+  mpz_init(root);
+  if (bits >= b)
+    mpz_tdiv_q_2exp(root, y, bits - b);
+  else
+    mpz_mul_2exp(root, y, b - bits);
+  mpz_tdiv_r_2exp(root, root, b);
 
+  std::atomic<bool> ambiguous{false};
 #pragma omp parallel
   {
 #pragma omp single
-    recursive_split(n, total_digits, out_buf, powers);
+    scaled_split(root, total_digits, 0, sink, powers, task_min_digits,
+                 ambiguous);
   }
+  mpz_clear(root);
+  return !ambiguous;
+}
 
-  out_buf[total_digits] = '\0';
+void BaseConverter::pack_words(const char *text, int64_t total_digits,
+                               uint64_t *words) {
+  const int64_t count = (total_digits + WORD_DIGITS - 1) / WORD_DIGITS;
+#pragma omp parallel for schedule(static)
+  for (int64_t i = 0; i < count; ++i) {
+    const int64_t first = i * WORD_DIGITS;
+    const int64_t k = std::min<int64_t>(WORD_DIGITS, total_digits - first);
+    uint64_t word = 0;
+    for (int64_t j = 0; j < k; ++j)
+      word = word * 10 + (uint64_t)(text[first + j] - '0');
+    words[i] = word * pow10_u64(WORD_DIGITS - (int)k);
+  }
+}
+
+void BaseConverter::fraction_to_hex(const mpz_t y, size_t bits,
+                                    int64_t total_digits, char *out_buf) {
+  static const char HEX[] = "0123456789abcdef";
+  const mp_limb_t *limbs = mpz_limbs_read(y);
+  const int64_t size = (int64_t)mpz_size(y);
+  // Bits [p, p + 64) of y, zeros outside it
+  auto bits_at = [&](int64_t p) {
+    const int64_t i = p >= 0 ? p / GMP_NUMB_BITS : -1 - (-p - 1) / GMP_NUMB_BITS;
+    const unsigned r = (unsigned)(p - i * GMP_NUMB_BITS);
+    const uint64_t lo = i >= 0 && i < size ? limbs[i] : 0;
+    const uint64_t hi = i + 1 >= 0 && i + 1 < size ? limbs[i + 1] : 0;
+    return r ? lo >> r | hi << (GMP_NUMB_BITS - r) : lo;
+  };
+  // Each group of 16 digits is the 64 bits below the previous one
+  const int64_t groups = (total_digits + 15) / 16;
+#pragma omp parallel for schedule(static)
+  for (int64_t g = 0; g < groups; ++g) {
+    const uint64_t w = bits_at((int64_t)bits - 64 * (g + 1));
+    char group[16];
+    for (int j = 0; j < 16; ++j)
+      group[j] = HEX[w >> (60 - 4 * j) & 15];
+    memcpy(out_buf + 16 * g, group,
+           (size_t)std::min<int64_t>(16, total_digits - 16 * g));
+  }
 }
 
 } // namespace pi
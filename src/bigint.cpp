@@ -1,13 +1,26 @@
 #include "bigint.hpp"
 #include "ntt.hpp"
+#include <algorithm>
 #include <omp.h>
 #include <vector>
 
 namespace pi {
 
+// R ~ 2^k / X, within a few units in the last place; meaningful to about
+// k - bits(X) bits. Bits of X below that precision are never read.
 void parallel_reciprocal(mpz_t R, const mpz_t X, size_t k) {
   size_t x_bits = mpz_sizeinbase(X, 2);
-  if (k < 2000 || x_bits < 2000) {
+  size_t p = k > x_bits ? k - x_bits : 0;
+  if (x_bits > p + 128) {
+    size_t s = x_bits - p - 64;
+    mpz_t X_top;
+    mpz_init(X_top);
+    mpz_tdiv_q_2exp(X_top, X, s);
+    parallel_reciprocal(R, X_top, k - s);
+    mpz_clear(X_top);
+    return;
+  }
+  if (p < 2000) {
     mpz_t t;
     mpz_init_set_ui(t, 1);
     mpz_mul_2exp(t, t, k);
@@ -16,95 +29,105 @@ void parallel_reciprocal(mpz_t R, const mpz_t X, size_t k) {
     return;
   }
 
-  mpz_t X_small, R_small;
-  mpz_inits(X_small, R_small, NULL);
-
-  size_t half_k = k / 2 + 128;
-  size_t shift = (x_bits > half_k) ? (x_bits - half_k) : 0;
-  
-  mpz_tdiv_q_2exp(X_small, X, shift);
-  parallel_reciprocal(R_small, X_small, half_k);
-
-  // Scale R_small back up
-  // R \approx 2^k / X
-  // R_small \approx 2^half_k / X_small = 2^half_k / (X >> shift) \approx 2^half_k / (X / 2^shift)
-  // R_small \approx 2^(half_k + shift) / X
-  // So R \approx R_small * 2^(k - half_k - shift)
-  if (k > half_k + shift) {
-    mpz_mul_2exp(R_small, R_small, k - half_k - shift);
-  } else {
-    mpz_tdiv_q_2exp(R_small, R_small, half_k + shift - k);
-  }
-  mpz_set(R, R_small);
-
-  // Newton iteration: R = R + R(2^k - XR) / 2^k
-  mpz_t E, T, p2k;
-  mpz_inits(E, T, p2k, NULL);
-
-  NTTMultiplier::multiply(E, X, R);
-  mpz_set_ui(p2k, 1);
-  mpz_mul_2exp(p2k, p2k, k);
-  mpz_sub(E, p2k, E);
-
-  NTTMultiplier::multiply(T, R, E);
-  mpz_tdiv_q_2exp(T, T, k);
-  mpz_add(R, R, T);
-
-  mpz_clears(X_small, R_small, E, T, p2k, NULL);
+  // Half the precision, R0 ~ 2^m / X, read from the top half of X
+  size_t half_p = p / 2 + 64;
+  size_t m = half_p + x_bits;
+  size_t t = k - m;
+  mpz_t R0;
+  mpz_init(R0);
+  parallel_reciprocal(R0, X, m);
+
+  // Newton step R = R + R (2^k - X R) / 2^k on R = R0 * 2^t, whose low t
+  // bits are zero: with e = 2^m - X R0 the correction is
+  // R0 * e / 2^(2m-k). |e| < 2^(m - half_p + 8), so X R0 mod 2^hi holds
+  // it, and only its top half, from bit u on, can reach the result: that
+  // middle of X R0 is all that is formed, and of R0 * e only the high
+  // part.
+  mpz_t E, C;
+  mpz_inits(E, C, NULL);
+  size_t hi = m - half_p + 16;
+  size_t u = x_bits + 64 > half_p ? x_bits + 64 - half_p : 0;
+  NTTMultiplier::multiply_middle(E, X, R0, u, hi);
+  mpz_neg(E, E); // e >> u, modulo 2^(hi - u)
+  mpz_fdiv_r_2exp(E, E, hi - u);
+  if (mpz_tstbit(E, hi - u - 1)) {
+    mpz_set_ui(C, 1);
+    mpz_mul_2exp(C, C, hi - u);
+    mpz_sub(E, E, C);
+  }
+
+  NTTMultiplier::multiply_high(C, E, R0, 2 * m - k - u);
+  mpz_mul_2exp(R, R0, t);
+  mpz_add(R, R, C);
+
+  mpz_clears(R0, E, C, NULL);
 }
 
+// R ~ 2^k / sqrt(X), within a few units in the last place; meaningful to
+// about k - bits(X)/2 bits. X is only read to the precision each level
+// needs, so it may be far larger or far smaller than R.
 void parallel_invsqrt(mpz_t R, const mpz_t X, size_t k) {
   size_t x_bits = mpz_sizeinbase(X, 2);
-  if (k < 2000 || x_bits < 2000) {
+  size_t p = k > x_bits / 2 ? k - x_bits / 2 : 0;
+  if (p < 2000) {
+    // floor(sqrt(floor(2^2k / X))) = floor(2^k / sqrt(X))
     mpz_t t;
-    mpz_init(t);
-    mpz_sqrt(t, X);
-    mpz_t r;
-    mpz_init_set_ui(r, 1);
-    mpz_mul_2exp(r, r, k);
-    mpz_tdiv_q(R, r, t);
-    mpz_clears(t, r, NULL);
+    mpz_init_set_ui(t, 1);
+    mpz_mul_2exp(t, t, 2 * k);
+    mpz_tdiv_q(t, t, X);
+    mpz_sqrt(R, t);
+    mpz_clear(t);
     return;
   }
 
-  mpz_t X_small, R_small;
-  mpz_inits(X_small, R_small, NULL);
-
-  size_t half_k = k / 2 + 128;
-  size_t shift = (x_bits > 2 * half_k) ? (x_bits - 2 * half_k) : 0;
-  if (shift % 2 != 0) shift++; 
-
-  mpz_tdiv_q_2exp(X_small, X, shift);
-  parallel_invsqrt(R_small, X_small, half_k);
-
-  // R \approx 2^k / sqrt(X)
-  // R_small \approx 2^half_k / sqrt(X_small) \approx 2^half_k / sqrt(X / 2^shift) = 2^(half_k + shift/2) / sqrt(X)
-  size_t target_shift = half_k + shift / 2;
-  if (k > target_shift) {
-    mpz_mul_2exp(R_small, R_small, k - target_shift);
-  } else {
-    mpz_tdiv_q_2exp(R_small, R_small, target_shift - k);
-  }
-  mpz_set(R, R_small);
-
-  // Newton iteration: R = R * (3*2^(2k) - X*R^2) / 2^(2k+1)
-  mpz_t R2, XR2, p2k3, T;
-  mpz_inits(R2, XR2, p2k3, T, NULL);
-
-  NTTMultiplier::multiply(R2, R, R);
-  NTTMultiplier::multiply(XR2, X, R2);
-  
-  mpz_set_ui(p2k3, 3);
-  mpz_mul_2exp(p2k3, p2k3, 2 * k);
-  mpz_sub(T, p2k3, XR2);
-  
-  NTTMultiplier::multiply(R2, R, T);
-  mpz_tdiv_q_2exp(R, R2, 2 * k + 1);
-
-  mpz_clears(X_small, R_small, R2, XR2, p2k3, T, NULL);
+  // Half the precision from the leading bits of X (an even number dropped
+  // keeps the root exact in scale): R0 ~ 2^m / sqrt(X) with m = k0 + s/2.
+  size_t half_p = p / 2 + 64;
+  size_t keep = 2 * half_p + 64;
+  size_t s = x_bits > keep ? x_bits - keep : 0;
+  s += s & 1;
+  mpz_t X_small, R0;
+  mpz_inits(X_small, R0, NULL);
+  mpz_tdiv_q_2exp(X_small, X, s);
+  size_t k0 = half_p + (x_bits - s) / 2;
+  parallel_invsqrt(R0, X_small, k0);
+  mpz_clear(X_small);
+  size_t m = k0 + s / 2;
+  size_t t = k - m;
+
+  // Newton step R = R + R (2^2k - X R^2) / 2^(2k+1) on R = R0 * 2^t, where
+  // the low t bits are zero: with e = 2^2m - X R0^2 the correction is
+  // R0 * e / 2^(2k+1-3t), of which only the high part is formed. |e| <
+  // 2^(2m - half_p + 8), so X R0^2 is only needed modulo 2^K - 1 for K
+  // past that: the wrapped square is about half the full one.
+  mpz_t E, C;
+  mpz_inits(E, C, NULL);
+  const size_t K = NTTMultiplier::wrap_bits(2 * m - half_p + 16);
+  NTTMultiplier::multiply_wrapped(E, R0, R0, K);
+  if (mpz_fits_ulong_p(X))
+    mpz_mul_ui(E, E, mpz_get_ui(X));
+  else
+    NTTMultiplier::multiply_wrapped(E, E, X, K);
+
+  // e = 2^(2m mod K) - X R0^2 modulo 2^K - 1, taken in (-2^(K-1), 2^(K-1))
+  mpz_set_ui(C, 1);
+  mpz_mul_2exp(C, C, (2 * m) % K);
+  mpz_sub(E, C, E);
+  mpz_set_ui(C, 1);
+  mpz_mul_2exp(C, C, K);
+  mpz_sub_ui(C, C, 1);
+  mpz_mod(E, E, C);
+  if (mpz_tstbit(E, K - 1))
+    mpz_sub(E, E, C);
+
+  NTTMultiplier::multiply_high(C, E, R0, 2 * k + 1 - 3 * t);
+  mpz_mul_2exp(R, R0, t);
+  mpz_add(R, R, C);
+
+  mpz_clears(R0, E, C, NULL);
 }
 
-// Tree-based Parallel Power: 10^N = 10^(N/2) * 10^(N/2)
+// Parallel Power by squaring: 10^N = (10^(N/2))^2 * 10^(N%2)
 void recursive_pow(mpz_t rop, uint64_t base, uint64_t exp) {
   if (exp == 0) {
     mpz_set_ui(rop, 1);
@@ -118,21 +141,13 @@ void recursive_pow(mpz_t rop, uint64_t base, uint64_t exp) {
   mpz_t half;
   mpz_init(half);
 
-  // For large exponents, split and calculate in parallel
+  // For large exponents: base^exp = (base^(exp/2))^2 * base^(exp%2). The
+  // parallelism comes from the squaring itself.
   if (exp > 100000) {
-    mpz_t res2;
-    mpz_init(res2);
-
-#pragma omp task shared(half)
     recursive_pow(half, base, exp / 2);
-
-#pragma omp task shared(res2)
-    recursive_pow(res2, base, exp - (exp / 2));
-
-#pragma omp taskwait
-
-    NTTMultiplier::multiply(rop, half, res2);
-    mpz_clear(res2);
+    NTTMultiplier::square(rop, half);
+    if (exp % 2 != 0)
+      mpz_mul_ui(rop, rop, base);
   } else {
     // Fallback to GMP's native power for smaller subproblems
     mpz_ui_pow_ui(rop, base, exp);
@@ -148,183 +163,90 @@ void BigInt::parallel_pow_ui(mpz_t rop, uint64_t base, uint64_t exp) {
   }
 }
 
-void parallel_reciprocal(mpz_t inv, const mpz_t B, size_t prec_bits) {
-  size_t m = mpz_sizeinbase(B, 2);
-  if (prec_bits <= 1500000) {
-    mpz_t B_top;
-    mpz_init(B_top);
-    if (m >= prec_bits) {
-      mpz_tdiv_q_2exp(B_top, B, m - prec_bits);
-    } else {
-      mpz_mul_2exp(B_top, B, prec_bits - m);
-    }
-    mpz_t num;
-    mpz_init(num);
-    mpz_set_ui(num, 1);
-    mpz_mul_2exp(num, num, 2 * prec_bits);
-    mpz_tdiv_q(inv, num, B_top);
-    mpz_clears(B_top, num, NULL);
-    return;
-  }
-
-  size_t half = (prec_bits + 1) / 2;
-  mpz_t inv_half;
-  mpz_init(inv_half);
-  parallel_reciprocal(inv_half, B, half);
-
-  size_t guard = 64;
-  size_t need_b_bits = prec_bits + guard;
-  mpz_t B_top;
-  mpz_init(B_top);
-  size_t shift_b = 0;
-  if (m > need_b_bits) {
-    shift_b = m - need_b_bits;
-    mpz_tdiv_q_2exp(B_top, B, shift_b);
-  } else {
-    mpz_set(B_top, B);
-  }
-  size_t m_top = mpz_sizeinbase(B_top, 2);
-
-  mpz_t BX, two_pow, term, prod;
-  mpz_inits(BX, two_pow, term, prod, NULL);
-
-  NTTMultiplier::multiply(BX, B_top, inv_half);
-  size_t target_pow = m_top + half;
-  mpz_set_ui(two_pow, 1);
-  mpz_mul_2exp(two_pow, two_pow, target_pow + 1);
-
-  mpz_sub(term, two_pow, BX);
-  NTTMultiplier::multiply(prod, inv_half, term);
-
-  size_t right_shift = m_top + 2 * half - prec_bits;
-  mpz_tdiv_q_2exp(inv, prod, right_shift);
-
-  mpz_clears(inv_half, B_top, BX, two_pow, term, prod, NULL);
-}
-
-void BigInt::parallel_div(mpz_t q, const mpz_t num, const mpz_t den) {
-  size_t n_bits = mpz_sizeinbase(num, 2);
-  size_t d_bits = mpz_sizeinbase(den, 2);
-
-  if (mpz_cmp(num, den) < 0) {
-    mpz_set_ui(q, 0);
-    return;
-  }
-
-  if (d_bits < 1500000 || (n_bits - d_bits) < 1500000) {
-    mpz_tdiv_q(q, num, den);
-    return;
-  }
-
-  size_t k = n_bits - d_bits + 5;
-  mpz_t inv;
-  mpz_init(inv);
-  parallel_reciprocal(inv, den, k);
-
-  mpz_t prod, rem;
-  mpz_inits(prod, rem, NULL);
-
-  NTTMultiplier::multiply(prod, num, inv);
-  mpz_tdiv_q_2exp(q, prod, d_bits + k);
-
-  NTTMultiplier::multiply(prod, q, den);
-  mpz_sub(rem, num, prod);
-
-  while (mpz_sgn(rem) < 0) {
-    mpz_sub_ui(q, q, 1);
-    mpz_add(rem, rem, den);
-  }
-  while (mpz_cmp(rem, den) >= 0) {
-    mpz_add_ui(q, q, 1);
-    mpz_sub(rem, rem, den);
-  }
-
-  mpz_clears(inv, prod, rem, NULL);
-}
-
-void BigInt::parallel_sqrt(mpz_t rop, const mpz_t n) {
-  size_t bits = mpz_sizeinbase(n, 2);
-  if (bits < 1000000000) { // GMP assembly is extremely fast for roots < 300M digits
-    mpz_sqrt(rop, n);
-    return;
-  }
-  // ... rest of the function ...
-
-  // To get a correct sqrt, the reciprocal needs to be scaled properly
-  size_t k = bits + 64; 
-  mpz_t inv;
-  mpz_init(inv);
-  
+void BigInt::parallel_sqrt_ui(mpz_t rop, unsigned long c, size_t k) {
+  // sqrt(c) = c / sqrt(c): the reciprocal root never needs a full-size
+  // division, and the bits of c it costs are bought back as extra precision
+  const size_t extra = 64 - __builtin_clzl(c | 1);
+  mpz_t c_z;
+  mpz_init_set_ui(c_z, c);
 #pragma omp parallel
   {
 #pragma omp single
-    parallel_invsqrt(inv, n, k);
-  }
-
-  NTTMultiplier::multiply(rop, n, inv);
-  mpz_tdiv_q_2exp(rop, rop, k);
-  
-  // Refine with GMP's native sqrt for final bits (very fast)
-  mpz_t rem;
-  mpz_init(rem);
-  mpz_mul(rem, rop, rop);
-  mpz_sub(rem, n, rem);
-  if (mpz_sgn(rem) < 0) {
-      mpz_sqrt(rop, n); // Fallback to safe version if Newton was off
-  } else {
-      // Newton is usually floor or floor-1
-      mpz_t next_rop;
-      mpz_init(next_rop);
-      mpz_add_ui(next_rop, rop, 1);
-      mpz_mul(next_rop, next_rop, next_rop);
-      if (mpz_cmp(next_rop, n) <= 0) {
-          mpz_sqrt(rop, n); // Just to be safe
-      }
-      mpz_clear(next_rop);
+    parallel_invsqrt(rop, c_z, k + extra);
   }
-  mpz_clear(rem);
-  mpz_clear(inv);
+  mpz_mul_ui(rop, rop, c);
+  mpz_tdiv_q_2exp(rop, rop, extra);
+  mpz_clear(c_z);
 }
 
-void BigInt::parallel_div(mpz_t q, const mpz_t num, const mpz_t den) {
+void BigInt::parallel_div(mpz_t q, const mpz_t num, const mpz_t den,
+                          size_t bits) {
   size_t n_bits = mpz_sizeinbase(num, 2);
   size_t d_bits = mpz_sizeinbase(den, 2);
-  
-  if (n_bits < 1000000 || d_bits < 500000) {
+  if (n_bits < 1000000 || d_bits < 500000 || n_bits < d_bits) {
     mpz_tdiv_q(q, num, den);
     return;
   }
 
-  size_t k = n_bits + 64;
-  mpz_t inv;
-  mpz_init(inv);
-  
+  // The quotient has q_bits or q_bits - 1 bits, and the caller wants its
+  // top `bits`. One bit more is formed, so that lsb, the weight of the last
+  // one, is 0 whenever the quotient fits in `bits` bits whichever its
+  // length; the spare bit is cut at the end. Y ~ num / den * 2^(g - lsb)
+  // carries g more, and the leading w bits of num and den determine it to
+  // well under a unit.
+  const size_t q_bits = n_bits - d_bits + 1;
+  const size_t target = std::min(bits + 1, q_bits);
+  const size_t lsb = q_bits - target;
+  const size_t g = GMP_NUMB_BITS;
+  const size_t w = target + g + 64;
+  const size_t sd = d_bits > w ? d_bits - w : 0;
+  const size_t sn = n_bits > w ? n_bits - w : 0;
+
+  mpz_t N, D, R;
+  mpz_inits(N, D, R, NULL);
+  mpz_tdiv_q_2exp(D, den, sd);
+  mpz_tdiv_q_2exp(N, num, sn);
+  const size_t k = (d_bits - sd) + w;
 #pragma omp parallel
   {
 #pragma omp single
-    parallel_reciprocal(inv, den, k);
+    parallel_reciprocal(R, D, k);
+  }
+  mpz_clear(D);
+
+  // num / den ~ N * R * 2^(sn - sd - k), of which only the high part is
+  // formed
+  NTTMultiplier::multiply_high(N, N, R, k + sd + lsb - g - sn);
+  mpz_clear(R);
+
+  // Y is within two units below and a fraction above the exact value, so
+  // its guard word decides the floor unless it sits at a carry boundary.
+  // Only then (about once in 2^62 divisions) is the remainder formed.
+  const mp_limb_t guard = mpz_getlimbn(N, 0);
+  mpz_tdiv_q_2exp(q, N, g);
+  mpz_clear(N);
+  if (lsb != 0) {
+    mpz_mul_2exp(q, q, lsb);
+  } else if (guard == 0 || guard >= ~(mp_limb_t)0 - 1) {
+    mpz_t rem;
+    mpz_init(rem);
+    mpz_mul(rem, q, den);
+    mpz_sub(rem, num, rem);
+    while (mpz_sgn(rem) < 0) {
+      mpz_sub_ui(q, q, 1);
+      mpz_add(rem, rem, den);
+    }
+    while (mpz_cmp(rem, den) >= 0) {
+      mpz_add_ui(q, q, 1);
+      mpz_sub(rem, rem, den);
+    }
+    mpz_clear(rem);
   }
-
-  NTTMultiplier::multiply(q, num, inv);
-  mpz_tdiv_q_2exp(q, q, k);
-  
-  // Correction step: Newton gives a very close approximation
-  mpz_t rem, prod;
-  mpz_inits(rem, prod, NULL);
-  mpz_mul(prod, q, den);
-  mpz_sub(rem, num, prod);
-  
-  // If the remainder is still larger than divisor, or negative,
-  // we use one final mpz_tdiv_q on the remainder for perfect accuracy.
-  if (mpz_cmp(rem, den) >= 0 || mpz_sgn(rem) < 0) {
-    mpz_t q_corr;
-    mpz_init(q_corr);
-    mpz_tdiv_q(q_corr, rem, den);
-    mpz_add(q, q, q_corr);
-    mpz_clear(q_corr);
+  const size_t length = mpz_sizeinbase(q, 2);
+  if (length > bits) {
+    mpz_tdiv_q_2exp(q, q, length - bits);
+    mpz_mul_2exp(q, q, length - bits);
   }
-  
-  mpz_clears(inv, rem, prod, NULL);
 }
 
 } // namespace pi
@@ -0,0 +1,205 @@
+#include "checkpoint.hpp"
+#include "bigint.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace pi {
+
+namespace {
+
+constexpr char MAGIC[8] = {'P', 'I', 'C', 'K', 'P', 'T', '0', '1'};
+
+// Layout check: limb width and byte order of the machine that wrote it
+constexpr uint64_t LAYOUT = 0x0102030405060700ull | GMP_LIMB_BITS;
+
+struct FileHeader {
+  char magic[8];
+  uint64_t layout;
+  int64_t digits;
+  uint64_t count;
+};
+
+struct IntegerHeader {
+  int64_t size; // signed limb count, as in mpz
+  uint64_t checksum;
+};
+
+uint64_t checksum(const mp_limb_t *limbs, size_t n) {
+  uint64_t h = 0x9e3779b97f4a7c15ull;
+  for (size_t i = 0; i < n; ++i)
+    h = (h ^ (uint64_t)limbs[i]) * 0x100000001b3ull;
+  return h;
+}
+
+// 64 MiB per call keeps the stdio layer out of the way without staging
+// whole integers anywhere
+constexpr size_t IO_CHUNK = (size_t)64 << 20;
+
+bool write_all(std::FILE *f, const void *data, size_t bytes) {
+  const char *p = static_cast<const char *>(data);
+  while (bytes > 0) {
+    size_t n = bytes < IO_CHUNK ? bytes : IO_CHUNK;
+    if (std::fwrite(p, 1, n, f) != n)
+      return false;
+    p += n;
+    bytes -= n;
+  }
+  return true;
+}
+
+bool read_all(std::FILE *f, void *data, size_t bytes) {
+  char *p = static_cast<char *>(data);
+  while (bytes > 0) {
+    size_t n = bytes < IO_CHUNK ? bytes : IO_CHUNK;
+    if (std::fread(p, 1, n, f) != n)
+      return false;
+    p += n;
+    bytes -= n;
+  }
+  return true;
+}
+
+bool sync(std::FILE *f) {
+  if (std::fflush(f) != 0)
+    return false;
+#ifdef _WIN32
+  return _commit(_fileno(f)) == 0;
+#else
+  return fsync(fileno(f)) == 0;
+#endif
+}
+
+struct FileCloser {
+  void operator()(std::FILE *f) const { std::fclose(f); }
+};
+using File = std::unique_ptr<std::FILE, FileCloser>;
+
+} // namespace
+
+Checkpoint::Checkpoint(std::string dir, int64_t digits, bool resume)
+    : dir(std::move(dir)), digits(digits), resume(resume) {
+  std::error_code ec;
+  std::filesystem::create_directories(this->dir, ec);
+}
+
+std::string Checkpoint::path(const std::string &name) const {
+  return dir + "/" + name + ".ckpt";
+}
+
+bool Checkpoint::save(const std::string &name,
+                      std::initializer_list<mpz_srcptr> values) const {
+  const std::string final_path = path(name);
+  const std::string tmp_path = final_path + ".tmp";
+  bool ok;
+  {
+    File f(std::fopen(tmp_path.c_str(), "wb"));
+    ok = f != nullptr;
+    FileHeader fh;
+    std::memcpy(fh.magic, MAGIC, sizeof MAGIC);
+    fh.layout = LAYOUT;
+    fh.digits = digits;
+    fh.count = values.size();
+    ok = ok && write_all(f.get(), &fh, sizeof fh);
+    for (mpz_srcptr v : values) {
+      if (!ok)
+        break;
+      const size_t n = mpz_size(v);
+      const mp_limb_t *limbs = n > 0 ? mpz_limbs_read(v) : nullptr;
+      IntegerHeader ih = {mpz_sgn(v) < 0 ? -(int64_t)n : (int64_t)n,
+                          checksum(limbs, n)};
+      ok = write_all(f.get(), &ih, sizeof ih) &&
+           write_all(f.get(), limbs, n * sizeof(mp_limb_t));
+    }
+    ok = ok && sync(f.get());
+  }
+#ifdef _WIN32
+  std::remove(final_path.c_str()); // rename does not replace on Windows
+#endif
+  ok = ok && std::rename(tmp_path.c_str(), final_path.c_str()) == 0;
+  if (!ok) {
+    std::fprintf(stderr, "\nCheckpoint %s not written: %s\n",
+                 final_path.c_str(), std::strerror(errno));
+    std::remove(tmp_path.c_str());
+  }
+  return ok;
+}
+
+bool Checkpoint::load(const std::string &name,
+                      std::initializer_list<mpz_ptr> values) const {
+  if (!resume)
+    return false;
+  File f(std::fopen(path(name).c_str(), "rb"));
+  if (f == nullptr)
+    return false;
+  FileHeader fh;
+  if (!read_all(f.get(), &fh, sizeof fh) ||
+      std::memcmp(fh.magic, MAGIC, sizeof MAGIC) != 0 ||
+      fh.layout != LAYOUT || fh.digits != digits ||
+      fh.count != values.size())
+    return false;
+
+  // Bytes after the header: a limb count that claims more is damage, and
+  // is caught before anything is allocated for it
+  std::error_code ec;
+  const uintmax_t file_bytes = std::filesystem::file_size(path(name), ec);
+  uintmax_t left = ec || file_bytes < sizeof fh ? 0 : file_bytes - sizeof fh;
+
+  // Decoded into temporaries so a damaged file leaves values untouched
+  std::vector<BigInt> read(values.size());
+  bool ok = true;
+  for (BigInt &r : read) {
+    IntegerHeader ih;
+    if (left < sizeof ih || !read_all(f.get(), &ih, sizeof ih)) {
+      ok = false;
+      break;
+    }
+    left -= sizeof ih;
+    const uint64_t n = ih.size < 0 ? 0 - (uint64_t)ih.size : (uint64_t)ih.size;
+    if (n > left / sizeof(mp_limb_t)) {
+      ok = false;
+      break;
+    }
+    left -= n * sizeof(mp_limb_t);
+    mp_limb_t *limbs = mpz_limbs_write(r.value, n > 0 ? n : 1);
+    if (!read_all(f.get(), limbs, n * sizeof(mp_limb_t)) ||
+        checksum(limbs, n) != ih.checksum) {
+      ok = false;
+      break;
+    }
+    mpz_limbs_finish(r.value, ih.size);
+  }
+  if (ok) {
+    size_t i = 0;
+    for (mpz_ptr v : values)
+      mpz_swap(v, read[i++].value);
+  } else {
+    std::fprintf(stderr, "\nCheckpoint %s is damaged, recomputing it\n",
+                 path(name).c_str());
+  }
+  return ok;
+}
+
+void Checkpoint::remove(const std::string &name) const {
+  std::remove(path(name).c_str());
+}
+
+void Checkpoint::remove_all(const std::string &prefix) const {
+  std::error_code ec;
+  for (const auto &entry : std::filesystem::directory_iterator(dir, ec)) {
+    const std::string file = entry.path().filename().string();
+    if (file.compare(0, prefix.size(), prefix) == 0)
+      std::filesystem::remove(entry.path(), ec);
+  }
+}
+
+} // namespace pi
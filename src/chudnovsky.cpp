@@ -1,115 +1,496 @@
-#include "bigint.hpp"
+#include "chudnovsky.hpp"
 #include "ntt.hpp"
+#include <algorithm>
+#include <climits>
+#include <cmath>
 #include <cstdint>
 #include <gmp.h>
-#include <iostream>
 #include <omp.h>
-
+#include <string>
+#include <vector>
 
 namespace pi {
 
-const uint64_t A = 13591409;
-const uint64_t B = 545140134;
+namespace {
 
-void calculate_base_single(int64_t k, mpz_t P, mpz_t Q, mpz_t T, mpz_t C3_24) {
-  if (k == 0) {
-    mpz_set_ui(P, 1);
-    mpz_set_ui(Q, 1);
-    mpz_set_ui(T, A);
-  } else {
-    mpz_set_ui(P, 6 * k - 5);
-    mpz_mul_ui(P, P, 2 * k - 1);
-    mpz_mul_ui(P, P, 6 * k - 1);
+constexpr uint64_t A = ChudnovskySeries::A;
+constexpr uint64_t B = ChudnovskySeries::B;
+constexpr unsigned long C3_24_LO = ChudnovskySeries::C3_24_LO;
+constexpr unsigned long C3_24_HI = ChudnovskySeries::C3_24_HI;
+
+// Multiplies x by a stream of word factors, packing as many into one
+// unsigned long as fit so each mpz pass covers several of them
+class WordProduct {
+public:
+  explicit WordProduct(mpz_t x) : x(x) {}
+  ~WordProduct() { flush(); }
+
+  void mul(unsigned long f) {
+    if (word > ULONG_MAX / f) {
+      mpz_mul_ui(x, x, word);
+      word = 1;
+    }
+    word *= f;
+  }
+
+  void flush() {
+    if (word != 1)
+      mpz_mul_ui(x, x, word);
+    word = 1;
+  }
+
+private:
+  mpz_ptr x;
+  unsigned long word = 1;
+};
+
+// P, Q, T over terms [a, b) in one left-to-right pass, merging one term
+// at a time: P *= p(k), T = T q(k) + P (A + B k), Q *= q(k). Every step is
+// a word multiply of an mpz that is already sized, so a block allocates
+// nothing; Q needs no prefix values and takes its factors in one stream.
+void split_block(int64_t a, int64_t b, mpz_t P, mpz_t Q, mpz_t T) {
+  mpz_set_ui(P, 1);
+  mpz_set_ui(Q, 1);
+  mpz_set_ui(T, 0);
+  WordProduct q_all(Q);
+  for (int64_t k = a; k < b; ++k) {
+    if (k == 0) { // p(0) = q(0) = 1
+      mpz_set_ui(T, A);
+      continue;
+    }
+    const unsigned long uk = (unsigned long)k;
+    {
+      WordProduct p(P);
+      p.mul(6 * uk - 5);
+      p.mul(2 * uk - 1);
+      p.mul(6 * uk - 1);
+    }
     mpz_neg(P, P);
+    {
+      WordProduct t(T);
+      for (int i = 0; i < 3; ++i)
+        t.mul(uk);
+      t.mul(C3_24_LO);
+      t.mul(C3_24_HI);
+    }
+    if (uk <= (ULONG_MAX - A) / B) {
+      mpz_addmul_ui(T, P, A + B * uk);
+    } else {
+      mpz_addmul_ui(T, P, A);
+      mpz_mul_ui(P, P, uk);
+      mpz_addmul_ui(T, P, B);
+      mpz_divexact_ui(P, P, uk);
+    }
+    for (int i = 0; i < 3; ++i)
+      q_all.mul(uk);
+    q_all.mul(C3_24_LO);
+    q_all.mul(C3_24_HI);
+  }
+}
+
+// Upper bounds on the bits of P, Q and T over terms [a, b), from the
+// per-term factors |p(k)| < 72 k^3 and q(k) = C3_24 k^3 < 2^53.29 k^3, with
+// sum log2 k taken from Stirling's series for log Gamma. T is a sum of
+// b - a terms each below Q (A + B b).
+void split_bits(int64_t a, int64_t b, size_t &p_bits, size_t &q_bits,
+                size_t &t_bits) {
+  auto log_gamma = [](double x) {
+    return (x - 0.5) * std::log(x) - x + 0.91893853320467274 + 1 / (12 * x);
+  };
+  int64_t a1 = std::max<int64_t>(a, 1);
+  double terms = (double)(b - a1);
+  double sum_log2_k = (log_gamma((double)b) - log_gamma((double)a1)) /
+                      0.69314718055994531;
+  double cubes = 3 * sum_log2_k;
+  p_bits = (size_t)(cubes + terms * 6.17 + 64);
+  q_bits = (size_t)(cubes + terms * 53.29 + 64);
+  t_bits = q_bits + 64 - __builtin_clzll((uint64_t)(b - a)) +
+           64 - __builtin_clzll((uint64_t)(A + B * b));
+}
+
+// Sizes the outputs of a split once so the products and the final sum
+// land in their buffers without regrowing them; returns the bound on T
+size_t presize(int64_t a, int64_t b, BigInt &P, BigInt &Q, BigInt &T) {
+  size_t p_bits, q_bits, t_bits;
+  split_bits(a, b, p_bits, q_bits, t_bits);
+  mpz_realloc2(P.value, p_bits);
+  mpz_realloc2(Q.value, q_bits);
+  mpz_realloc2(T.value, t_bits);
+  return t_bits;
+}
+
+struct PrimePower {
+  uint32_t prime;
+  uint32_t power;
+};
 
-    mpz_set_ui(Q, k);
-    mpz_mul_ui(Q, Q, k);
-    mpz_mul_ui(Q, Q, k);
-    mpz_mul(Q, Q, C3_24);
+using FactorList = std::vector<PrimePower>;
 
-    mpz_set_ui(T, B);
-    mpz_mul_ui(T, T, k);
-    mpz_add_ui(T, T, A);
-    mpz_mul(T, T, P);
+// Sorts a list of prime powers and merges repeated primes
+void normalize(FactorList &f) {
+  std::sort(f.begin(), f.end(), [](const PrimePower &x, const PrimePower &y) {
+    return x.prime < y.prime;
+  });
+  size_t out = 0;
+  for (size_t i = 0; i < f.size(); ++i) {
+    if (out > 0 && f[out - 1].prime == f[i].prime)
+      f[out - 1].power += f[i].power;
+    else
+      f[out++] = f[i];
   }
+  f.resize(out);
 }
 
-static int64_t total_it = 0;
-static int64_t completed_it = 0;
-
-void BigInt::binary_split(int64_t a, int64_t b, BigInt &P, BigInt &Q,
-                          BigInt &T) {
-  static mpz_t C3_24;
-  static bool init_done = false;
-#pragma omp critical
-  {
-    if (!init_done) {
-      mpz_init_set_str(C3_24, "10939058860032000", 10);
-      total_it = b;
-      completed_it = 0;
-      init_done = true;
+// x * y of two normalized lists
+FactorList multiply(const FactorList &x, const FactorList &y) {
+  FactorList r;
+  r.reserve(x.size() + y.size());
+  size_t i = 0, j = 0;
+  while (i < x.size() || j < y.size()) {
+    if (j == y.size() || (i < x.size() && x[i].prime < y[j].prime)) {
+      r.push_back(x[i++]);
+    } else if (i == x.size() || y[j].prime < x[i].prime) {
+      r.push_back(y[j++]);
+    } else {
+      r.push_back({x[i].prime, x[i].power + y[j].power});
+      ++i, ++j;
     }
   }
+  return r;
+}
+
+// Takes gcd(x, y) out of both lists and returns it
+FactorList remove_common(FactorList &x, FactorList &y) {
+  FactorList g;
+  size_t i = 0, j = 0, xo = 0, yo = 0;
+  while (i < x.size() && j < y.size()) {
+    if (x[i].prime < y[j].prime) {
+      x[xo++] = x[i++];
+    } else if (y[j].prime < x[i].prime) {
+      y[yo++] = y[j++];
+    } else {
+      uint32_t e = std::min(x[i].power, y[j].power);
+      g.push_back({x[i].prime, e});
+      if (x[i].power > e)
+        x[xo++] = {x[i].prime, x[i].power - e};
+      if (y[j].power > e)
+        y[yo++] = {y[j].prime, y[j].power - e};
+      ++i, ++j;
+    }
+  }
+  while (i < x.size())
+    x[xo++] = x[i++];
+  while (j < y.size())
+    y[yo++] = y[j++];
+  x.resize(xo);
+  y.resize(yo);
+  return g;
+}
+
+// Product of words [from, to) by a balanced tree of mpz products
+void product_tree(const std::vector<unsigned long> &words, size_t from,
+                  size_t to, mpz_t rop) {
+  if (to - from <= 16) {
+    mpz_set_ui(rop, 1);
+    WordProduct w(rop);
+    for (size_t i = from; i < to; ++i)
+      w.mul(words[i]);
+    return;
+  }
+  size_t mid = from + (to - from) / 2;
+  mpz_t right;
+  mpz_init(right);
+  product_tree(words, from, mid, rop);
+  product_tree(words, mid, to, right);
+  mpz_mul(rop, rop, right);
+  mpz_clear(right);
+}
+
+// Value of a factor list, with the prime powers packed into words first
+void expand(const FactorList &f, mpz_t rop) {
+  std::vector<unsigned long> words;
+  unsigned long word = 1;
+  for (const PrimePower &pp : f)
+    for (uint32_t e = 0; e < pp.power; ++e) {
+      if (word > ULONG_MAX / pp.prime) {
+        words.push_back(word);
+        word = 1;
+      }
+      word *= pp.prime;
+    }
+  words.push_back(word);
+  product_tree(words, 0, words.size(), rop);
+}
+
+} // namespace
+
+struct ChudnovskySeries::Factors {
+  FactorList p, q;
+};
 
-  if (b - a == 1) {
-    calculate_base_single(a, P.value, Q.value, T.value, C3_24);
-#pragma omp atomic
-    completed_it++;
-    if (completed_it % 1000000 == 0) {
-#pragma omp critical
-      {
-        printf("\rStep 1 Progress: %lld / %lld terms", (long long)completed_it,
-               (long long)total_it);
-        fflush(stdout);
+// Smallest prime factor of every n in [1, limit] coprime to 6, stored at
+// n / 3 (6j + 1 -> 2j, 6j + 5 -> 2j + 1) with 0 for primes. Composites up
+// to 2^32 have a factor below 2^16, so two bytes an entry suffice: 2/3 of
+// a byte per sieved integer, 4 bytes per series term.
+class ChudnovskySeries::FactorSieve {
+public:
+  static constexpr uint64_t MAX_LIMIT = UINT32_MAX;
+
+  // Fills the table with tasks on the current team
+  explicit FactorSieve(uint64_t limit) : limit(limit), spf(limit / 3 + 1, 0) {
+    uint64_t root = 5;
+    while (root * root <= limit)
+      ++root;
+    std::vector<uint32_t> primes;
+    std::vector<bool> composite(root + 1, false);
+    for (uint64_t p = 5; p <= root; ++p) {
+      if (composite[p])
+        continue;
+      for (uint64_t m = p * p; m <= root; m += p)
+        composite[m] = true;
+      if (p % 3 != 0 && p % 2 != 0)
+        primes.push_back((uint32_t)p);
+    }
+
+    // Each segment applies every sieving prime in increasing order, so an
+    // entry is set by its smallest factor whichever thread runs it
+    const uint64_t segment = (uint64_t)1 << 20;
+    const int64_t segments = (int64_t)((limit + segment) / segment);
+#pragma omp taskloop shared(primes) grainsize(1)
+    for (int64_t s = 0; s < segments; ++s) {
+      const uint64_t lo = (uint64_t)s * segment;
+      const uint64_t hi = std::min(limit + 1, lo + segment);
+      for (uint32_t p : primes) {
+        uint64_t m = std::max<uint64_t>((uint64_t)p * p, (lo + p - 1) / p * p);
+        if (m % 2 == 0)
+          m += p;
+        for (; m < hi; m += 2 * (uint64_t)p)
+          if (m % 3 != 0 && spf[m / 3] == 0)
+            spf[m / 3] = (uint16_t)p;
       }
     }
+  }
+
+  uint64_t covers() const { return limit; }
+
+  // Factorizations of P and Q over terms [a, b), with 6 b <= covers()
+  void block(int64_t a, int64_t b, Factors &f) const {
+    f.p.clear();
+    f.q.clear();
+    uint32_t n = 0;
+    for (int64_t k = std::max<int64_t>(a, 1); k < b; ++k, ++n) {
+      factor(6 * k - 5, 1, f.p);
+      factor(2 * k - 1, 1, f.p);
+      factor(6 * k - 1, 1, f.p);
+      factor(k, 3, f.q);
+    }
+    if (n > 0) // C3_24 = 2^15 3^2 5^3 23^3 29^3 per term
+      f.q.insert(f.q.end(),
+                 {{2, 15 * n}, {3, 2 * n}, {5, 3 * n}, {23, 3 * n}, {29, 3 * n}});
+    normalize(f.p);
+    normalize(f.q);
+  }
+
+  // Appends the factorization of n^power
+  void factor(uint64_t n, uint32_t power, FactorList &out) const {
+    if (int twos = __builtin_ctzll(n)) {
+      out.push_back({2, twos * power});
+      n >>= twos;
+    }
+    uint32_t threes = 0;
+    for (; n % 3 == 0; n /= 3)
+      ++threes;
+    if (threes > 0)
+      out.push_back({3, threes * power});
+    while (n > 1) {
+      uint64_t p = spf[n / 3] != 0 ? spf[n / 3] : n;
+      uint32_t e = 0;
+      for (; n % p == 0; n /= p)
+        ++e;
+      out.push_back({(uint32_t)p, e * power});
+    }
+  }
+
+private:
+  uint64_t limit;
+  std::vector<uint16_t> spf;
+};
+
+ChudnovskySeries::ChudnovskySeries(int64_t terms, bool reduce_gcd)
+    : total(terms), slots(omp_get_max_threads()),
+      counters(new Counter[slots]), reduce_gcd(reduce_gcd) {}
+
+ChudnovskySeries::~ChudnovskySeries() = default;
+
+void ChudnovskySeries::bound_bits(int64_t a, int64_t b, size_t &p_bits,
+                                  size_t &q_bits, size_t &t_bits) {
+  split_bits(a, b, p_bits, q_bits, t_bits);
+}
+
+void ChudnovskySeries::compute(BigInt &P, BigInt &Q, BigInt &T) {
+  for (int i = 0; i < slots; ++i)
+    counters[i].terms.store(0, std::memory_order_relaxed);
+  auto run = [&] {
+    if (reduce_gcd && !sieve)
+      sieve.reset(new FactorSieve(std::min<uint64_t>(
+          6 * (uint64_t)total, FactorSieve::MAX_LIMIT)));
+    split(0, total, P, Q, T, nullptr);
+  };
+  if (omp_in_parallel()) {
+    run();
+  } else {
+#pragma omp parallel
+    {
+#pragma omp single
+      run();
+    }
+  }
+}
+
+int64_t ChudnovskySeries::completed() const {
+  int64_t sum = 0;
+  for (int i = 0; i < slots; ++i)
+    sum += counters[i].terms.load(std::memory_order_relaxed);
+  return sum;
+}
+
+void ChudnovskySeries::cancel_common(BigInt &P1, BigInt &Q2, Factors &left,
+                                     Factors &right, Factors *factors) {
+  FactorList g = remove_common(left.p, right.q);
+  if (!g.empty()) {
+    mpz_t gv;
+    mpz_init(gv);
+    expand(g, gv);
+    mpz_divexact(P1.value, P1.value, gv);
+    mpz_divexact(Q2.value, Q2.value, gv);
+    mpz_clear(gv);
+  }
+  if (factors) {
+    factors->p = multiply(left.p, right.p);
+    factors->q = multiply(left.q, right.q);
+  }
+}
+
+void ChudnovskySeries::split_unit(int64_t a, int64_t b, BigInt &P, BigInt &Q,
+                                  BigInt &T) {
+  // Any scaling of (P, Q, T) by a common factor merges correctly, so a
+  // unit saved with or without --gcd serves either kind of run
+  const std::string name =
+      "split_" + std::to_string(a) + "_" + std::to_string(b);
+  if (checkpoint->load(name, {P.value, Q.value, T.value})) {
+    counters[omp_get_thread_num() % slots].terms.fetch_add(
+        b - a, std::memory_order_relaxed);
+    return;
+  }
+  split(a, b, P, Q, T, nullptr);
+  checkpoint->save(name, {P.value, Q.value, T.value});
+}
+
+void ChudnovskySeries::split(int64_t a, int64_t b, BigInt &P, BigInt &Q,
+                             BigInt &T, Factors *factors) {
+  const size_t t_bits = presize(a, b, P, Q, T);
+  if (b - a <= LEAF_TERMS) {
+    split_block(a, b, P.value, Q.value, T.value);
+    if (factors)
+      sieve->block(a, b, *factors);
+    // Threads of a team larger than the one sized for share a slot, so
+    // the add stays atomic; normally it is uncontended.
+    counters[omp_get_thread_num() % slots].terms.fetch_add(
+        b - a, std::memory_order_relaxed);
     return;
   }
 
   int64_t m = (a + b) / 2;
 
+  // Common factors of P1 and Q2 are removed wherever the sieve reaches and
+  // the factor lists stay short. Merging with g = gcd(P1, Q2),
+  //   T = T1 (Q2 / g) + (P1 / g) T2,  P = (P1 / g) P2,  Q = Q1 (Q2 / g)
+  // is the unreduced result divided by g, and the callers only use the
+  // ratios P / Q and T / Q.
+  const bool factored = sieve && b - a <= FACTOR_MAX_TERMS &&
+                        6 * (uint64_t)b <= sieve->covers();
+  Factors left, right;
+  Factors *fl = factored ? &left : nullptr;
+  Factors *fr = factored ? &right : nullptr;
+
+  // Halves that are checkpoint units go through split_unit()
+  const int64_t unit = checkpoint ? checkpoint_terms() : 0;
+  auto half = [&](int64_t lo, int64_t hi, BigInt &Ph, BigInt &Qh, BigInt &Th,
+                  Factors *fh) {
+    if (b - a > unit && hi - lo <= unit)
+      split_unit(lo, hi, Ph, Qh, Th);
+    else
+      split(lo, hi, Ph, Qh, Th, fh);
+  };
+
   // Optimized tasking: only spawn tasks for large enough chunks to save RAM
-  if (b - a > 100000) {
+  if (b - a > task_min_terms) {
     BigInt P1, Q1, T1, P2, Q2, T2;
-#pragma omp task shared(P1, Q1, T1)
-    binary_split(a, m, P1, Q1, T1);
-#pragma omp task shared(P2, Q2, T2)
-    binary_split(m, b, P2, Q2, T2);
+#pragma omp task shared(P1, Q1, T1, left, half)
+    half(a, m, P1, Q1, T1, fl);
+#pragma omp task shared(P2, Q2, T2, right, half)
+    half(m, b, P2, Q2, T2, fr);
 #pragma omp taskwait
+    if (factored)
+      cancel_common(P1, Q2, left, right, factors);
 
     mpz_t T_part2;
-    mpz_init(T_part2);
+    mpz_init2(T_part2, t_bits);
 
     // High-level merge: use tasking instead of nested parallel regions
     // T = T1*Q2 + P1*T2, P = P1*P2, Q = Q1*Q2
-#pragma omp task shared(T, T1, Q2)
-    NTTMultiplier::multiply(T.value, T1.value, Q2.value);
-#pragma omp task shared(T_part2, P1, T2)
-    NTTMultiplier::multiply(T_part2, P1.value, T2.value);
-#pragma omp task shared(P, P1, P2)
-    NTTMultiplier::multiply(P.value, P1.value, P2.value);
-#pragma omp task shared(Q, Q1, Q2)
-    NTTMultiplier::multiply(Q.value, Q1.value, Q2.value);
+    // Q2 and P1 each appear in two products, so they are transformed once.
+    // Below a breadth of 4 the T products run first and T1, T2 are freed
+    // before P and Q start; at 1 every task runs undeferred, in order.
+    const bool concurrent = merge_breadth > 1;
+    NTTMultiplier::TransformedOperand Q2_hat, P1_hat;
+#pragma omp task shared(Q2_hat, Q2, T1, Q1) if (concurrent)
+    Q2_hat = NTTMultiplier::transform(
+        Q2.value, std::max(mpz_sizeinbase(T1.value, 2),
+                           mpz_sizeinbase(Q1.value, 2)));
+#pragma omp task shared(P1_hat, P1, T2, P2) if (concurrent)
+    P1_hat = NTTMultiplier::transform(
+        P1.value, std::max(mpz_sizeinbase(T2.value, 2),
+                           mpz_sizeinbase(P2.value, 2)));
+#pragma omp taskwait
+
+    auto finish_t = [&] {
+      T1.clear();
+      T2.clear();
+      mpz_add(T.value, T.value, T_part2);
+      mpz_clear(T_part2);
+    };
+#pragma omp task shared(T, T1, Q2_hat) if (concurrent)
+    NTTMultiplier::multiply(T.value, T1.value, Q2_hat);
+#pragma omp task shared(T_part2, T2, P1_hat) if (concurrent)
+    NTTMultiplier::multiply(T_part2, T2.value, P1_hat);
+    if (merge_breadth < 4) {
+#pragma omp taskwait
+      finish_t();
+    }
+#pragma omp task shared(P, P2, P1_hat) if (concurrent)
+    NTTMultiplier::multiply(P.value, P2.value, P1_hat);
+#pragma omp task shared(Q, Q1, Q2_hat) if (concurrent)
+    NTTMultiplier::multiply(Q.value, Q1.value, Q2_hat);
 #pragma omp taskwait
 
     // Early clear: these are no longer needed after the merge
-    T1.clear();
-    T2.clear();
     Q1.clear();
     P1.clear();
     P2.clear();
     Q2.clear();
-
-    mpz_add(T.value, T.value, T_part2);
-    mpz_clear(T_part2);
+    if (merge_breadth >= 4)
+      finish_t();
   } else {
     BigInt P1, Q1, T1, P2, Q2, T2;
-    binary_split(a, m, P1, Q1, T1);
-    binary_split(m, b, P2, Q2, T2);
+    half(a, m, P1, Q1, T1, fl);
+    half(m, b, P2, Q2, T2, fr);
+    if (factored)
+      cancel_common(P1, Q2, left, right, factors);
 
     mpz_t T_part2;
-    mpz_init(T_part2);
-    
+    mpz_init2(T_part2, t_bits);
+
     // T = T1*Q2 + P1*T2
     mpz_mul(T.value, T1.value, Q2.value);
     mpz_mul(T_part2, P1.value, T2.value);
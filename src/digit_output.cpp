@@ -0,0 +1,172 @@
+#include "digit_output.hpp"
+#include "limb_arena.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace pi {
+
+namespace {
+
+// "pi.txt" -> "pi_0003.txt"
+std::string shard_name(const std::string &path, size_t index) {
+  const size_t slash = path.find_last_of("/\\");
+  size_t dot = path.rfind('.');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+    dot = path.size();
+  char suffix[32];
+  std::snprintf(suffix, sizeof(suffix), "_%04zu", index);
+  return path.substr(0, dot) + suffix + path.substr(dot);
+}
+
+std::string part_name(const std::string &path) { return path + ".part"; }
+
+} // namespace
+
+DigitOutput::~DigitOutput() {
+  if (base)
+    discard();
+}
+
+bool DigitOutput::open(const std::string &path, size_t data_bytes,
+                       size_t shard_bytes, size_t header_bytes) {
+  bytes = data_bytes;
+  const size_t page = shard_granularity();
+  shard = shard_bytes == 0 ? bytes : shard_bytes;
+  shard = (shard + page - 1) / page * page;
+  header = (header_bytes + page - 1) / page * page;
+  const size_t count = (bytes + shard - 1) / shard;
+  paths.clear();
+  for (size_t i = 0; i < count; ++i)
+    paths.push_back(shard_bytes == 0 ? path : shard_name(path, i));
+  headers.assign(count, std::string());
+  reserved = count * shard;
+
+#ifdef _WIN32
+  base = static_cast<char *>(LimbArena::allocate(reserved));
+  return true;
+#else
+  // One reservation of address space, then the data of each file mapped
+  // over its slice of it: the shards read as one contiguous block
+  void *area = mmap(nullptr, reserved, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (area == MAP_FAILED) {
+    std::fprintf(stderr, "Cannot reserve %zu bytes of address space for %s: "
+                         "%s\n", reserved, path.c_str(), std::strerror(errno));
+    return false;
+  }
+  base = static_cast<char *>(area);
+
+  for (size_t i = 0; i < count; ++i) {
+    const size_t length = std::min(shard, bytes - i * shard);
+    const std::string part = part_name(paths[i]);
+    int fd = ::open(part.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int err = fd < 0 ? errno : 0;
+    // Reserved so a full disk fails here rather than as a SIGBUS later
+    if (!err)
+      err = posix_fallocate(fd, 0, (off_t)(header + length));
+    if (!err && mmap(base + i * shard, length, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_FIXED, fd, (off_t)header) == MAP_FAILED)
+      err = errno;
+    if (fd >= 0)
+      ::close(fd); // the mapping keeps the file open
+    if (err) {
+      std::fprintf(stderr, "Cannot create %s (%zu bytes): %s\n", part.c_str(),
+                   header + length, std::strerror(err));
+      paths.resize(i + 1);
+      discard();
+      return false;
+    }
+  }
+  return true;
+#endif
+}
+
+size_t DigitOutput::shard_granularity() {
+#ifdef _WIN32
+  return 4096;
+#else
+  static const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  return page;
+#endif
+}
+
+void DigitOutput::set_header(size_t file, std::string text) {
+  if (text.size() > header)
+    text.resize(header);
+  headers[file] = std::move(text);
+}
+
+bool DigitOutput::close() {
+  bool ok = base != nullptr;
+#ifdef _WIN32
+  for (size_t i = 0; ok && i < paths.size(); ++i) {
+    const size_t length = std::min(shard, bytes - i * shard);
+    std::string room = headers[i];
+    room.resize(header, '\0');
+    FILE *f = std::fopen(part_name(paths[i]).c_str(), "wb");
+    ok = f && std::fwrite(room.data(), 1, header, f) == header &&
+         std::fwrite(base + i * shard, 1, length, f) == length;
+    if (f)
+      ok = std::fclose(f) == 0 && ok;
+  }
+  if (base)
+    LimbArena::release(base, reserved);
+#else
+  // The page cache already holds every digit, much of it written back
+  // during the conversion; the rest is flushed before the files are
+  // renamed, so a run that reports success has its digits on disk
+  for (size_t i = 0; ok && i < paths.size(); ++i) {
+    const size_t length = std::min(shard, bytes - i * shard);
+    ok = msync(base + i * shard, length, MS_SYNC) == 0;
+  }
+  if (base)
+    munmap(base, reserved);
+  for (size_t i = 0; ok && i < paths.size(); ++i) {
+    if (headers[i].empty())
+      continue;
+    int fd = ::open(part_name(paths[i]).c_str(), O_WRONLY);
+    ok = fd >= 0 && pwrite(fd, headers[i].data(), headers[i].size(), 0) ==
+                        (ssize_t)headers[i].size();
+    ok = ok && fsync(fd) == 0;
+    if (fd >= 0)
+      ok = ::close(fd) == 0 && ok;
+  }
+#endif
+  base = nullptr;
+  // A failure leaves the earlier output and the .part files as they are
+  for (size_t i = 0; ok && i < paths.size(); ++i) {
+#ifdef _WIN32
+    std::remove(paths[i].c_str()); // rename does not replace on Windows
+#endif
+    ok = std::rename(part_name(paths[i]).c_str(), paths[i].c_str()) == 0;
+  }
+  return ok;
+}
+
+void DigitOutput::discard() {
+#ifdef _WIN32
+  LimbArena::release(base, reserved);
+#else
+  munmap(base, reserved);
+#endif
+  base = nullptr;
+  for (const std::string &p : paths)
+    std::remove(part_name(p).c_str());
+}
+
+#ifdef _WIN32
+const bool DigitOutput::MAPPED = false;
+#else
+const bool DigitOutput::MAPPED = true;
+#endif
+
+} // namespace pi
@@ -0,0 +1,430 @@
+#include "fft.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <gmp.h>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace pi {
+
+namespace {
+
+struct Cx {
+  double re, im;
+};
+
+constexpr double EPS = DBL_EPSILON / 2; // unit roundoff, 2^-53
+
+// Twiddles are evaluated in long double and rounded once, so each is
+// within about one unit roundoff of the true root; without a wider long
+// double the argument reduction costs a few more ulps.
+constexpr double BETA = (LDBL_MANT_DIG > DBL_MANT_DIG ? 2 : 8) * EPS;
+
+// Stages with a half-length below LOCAL_LEN run block by block, each block
+// small enough to stay in cache for all of its remaining stages.
+constexpr size_t LOCAL_LEN = 1 << 12;
+constexpr size_t STAGE_GRAIN = 2048; // butterflies per task in wide stages
+
+// exp(-2*pi*i * j / (2h)) for j < h, one table per h = 2^log_half
+const Cx *twiddles(int log_half) {
+  static std::atomic<const Cx *> table[FFTMultiplier::MAX_LOG_LEN];
+  static std::mutex lock;
+
+  const Cx *w = table[log_half].load(std::memory_order_acquire);
+  if (w)
+    return w;
+  std::lock_guard<std::mutex> guard(lock);
+  w = table[log_half].load(std::memory_order_relaxed);
+  if (!w) {
+    const size_t h = (size_t)1 << log_half;
+    Cx *t = new Cx[h];
+    // The next longer table holds the same roots at even indices
+    const Cx *longer = log_half + 1 < FFTMultiplier::MAX_LOG_LEN
+                           ? table[log_half + 1].load(std::memory_order_relaxed)
+                           : nullptr;
+    const long double pi = 3.141592653589793238462643383279502884L;
+    for (size_t j = 0; j < h; ++j) {
+      if (longer) {
+        t[j] = longer[2 * j];
+      } else {
+        long double angle = -pi * (long double)j / (long double)h;
+        t[j] = {(double)std::cos(angle), (double)std::sin(angle)};
+      }
+    }
+    table[log_half].store(t, std::memory_order_release);
+    w = t;
+  }
+  return w;
+}
+
+int log2_exact(size_t n) {
+  int lg = 0;
+  while (((size_t)1 << lg) < n)
+    lg++;
+  return lg;
+}
+
+inline Cx add(Cx a, Cx b) { return {a.re + b.re, a.im + b.im}; }
+inline Cx sub(Cx a, Cx b) { return {a.re - b.re, a.im - b.im}; }
+inline Cx mul(Cx a, Cx w) {
+  return {a.re * w.re - a.im * w.im, a.re * w.im + a.im * w.re};
+}
+inline Cx mul_conj(Cx a, Cx w) {
+  return {a.re * w.re + a.im * w.im, a.im * w.re - a.re * w.im};
+}
+
+// Two radix-2 stages fused so each element is loaded and stored once:
+// half-lengths 2q (twiddles w) then q (twiddles v) in decimation in
+// frequency, the reverse in decimation in time. The arithmetic is exactly
+// that of the two separate stages, so the radix-2 error bound still holds.
+inline void dif4(Cx *a, size_t q, const Cx *w, const Cx *v, size_t j0,
+                 size_t j1) {
+  for (size_t j = j0; j < j1; ++j) {
+    Cx x0 = a[j], x1 = a[j + q], x2 = a[j + 2 * q], x3 = a[j + 3 * q];
+    Cx y0 = add(x0, x2), y2 = mul(sub(x0, x2), w[j]);
+    Cx y1 = add(x1, x3), y3 = mul(sub(x1, x3), w[j + q]);
+    a[j] = add(y0, y1);
+    a[j + q] = mul(sub(y0, y1), v[j]);
+    a[j + 2 * q] = add(y2, y3);
+    a[j + 3 * q] = mul(sub(y2, y3), v[j]);
+  }
+}
+
+inline void dit4(Cx *a, size_t q, const Cx *w, const Cx *v, size_t j0,
+                 size_t j1) {
+  for (size_t j = j0; j < j1; ++j) {
+    Cx x0 = a[j], x1 = mul_conj(a[j + q], v[j]);
+    Cx x2 = a[j + 2 * q], x3 = mul_conj(a[j + 3 * q], v[j]);
+    Cx y0 = add(x0, x1), y1 = sub(x0, x1);
+    Cx y2 = mul_conj(add(x2, x3), w[j]), y3 = mul_conj(sub(x2, x3), w[j + q]);
+    a[j] = add(y0, y2);
+    a[j + q] = add(y1, y3);
+    a[j + 2 * q] = sub(y0, y2);
+    a[j + 3 * q] = sub(y1, y3);
+  }
+}
+
+// Single radix-2 stage of half-length h over j in [j0, j1) of one block
+inline void dif2(Cx *a, size_t h, const Cx *w, size_t j0, size_t j1) {
+  for (size_t j = j0; j < j1; ++j) {
+    Cx u = a[j], v = a[j + h];
+    a[j] = add(u, v);
+    a[j + h] = mul(sub(u, v), w[j]);
+  }
+}
+
+inline void dit2(Cx *a, size_t h, const Cx *w, size_t j0, size_t j1) {
+  for (size_t j = j0; j < j1; ++j) {
+    Cx u = a[j], v = mul_conj(a[j + h], w[j]);
+    a[j] = add(u, v);
+    a[j + h] = sub(u, v);
+  }
+}
+
+// The last two forward (first two inverse) stages of every 4-element group,
+// whose twiddles 1 and -i are applied exactly.
+inline void dif4_unit(Cx *a, size_t len) {
+  for (size_t i = 0; i < len; i += 4) {
+    Cx y0 = add(a[i], a[i + 2]), d2 = sub(a[i], a[i + 2]);
+    Cx y1 = add(a[i + 1], a[i + 3]), d3 = sub(a[i + 1], a[i + 3]);
+    Cx y3 = {d3.im, -d3.re};
+    a[i] = add(y0, y1);
+    a[i + 1] = sub(y0, y1);
+    a[i + 2] = add(d2, y3);
+    a[i + 3] = sub(d2, y3);
+  }
+}
+
+inline void dit4_unit(Cx *a, size_t len) {
+  for (size_t i = 0; i < len; i += 4) {
+    Cx y0 = add(a[i], a[i + 1]), y1 = sub(a[i], a[i + 1]);
+    Cx y2 = add(a[i + 2], a[i + 3]), d3 = sub(a[i + 2], a[i + 3]);
+    Cx y3 = {-d3.im, d3.re};
+    a[i] = add(y0, y2);
+    a[i + 1] = add(y1, y3);
+    a[i + 2] = sub(y0, y2);
+    a[i + 3] = sub(y1, y3);
+  }
+}
+
+// Stage pair (log_q + 1, log_q), or the single stage log_q when Pair is
+// false, over the whole array in equal chunks. Needs 2^log_q >= STAGE_GRAIN.
+template <bool Forward, bool Pair>
+void wide_stages(Cx *a, size_t n, int log_q) {
+  const size_t q = (size_t)1 << log_q;
+  const size_t block = Pair ? 4 * q : 2 * q;
+  const Cx *w = twiddles(Pair ? log_q + 1 : log_q);
+  const Cx *v = twiddles(log_q);
+  const size_t chunks = n / (Pair ? 4 : 2) / STAGE_GRAIN;
+#pragma omp taskloop firstprivate(a, w, v, q, block) grainsize(1)
+  for (size_t c = 0; c < chunks; ++c) {
+    size_t first = c * STAGE_GRAIN;
+    Cx *x = a + (first / q) * block;
+    size_t j0 = first % q, j1 = j0 + STAGE_GRAIN;
+    if (Pair)
+      Forward ? dif4(x, q, w, v, j0, j1) : dit4(x, q, w, v, j0, j1);
+    else
+      Forward ? dif2(x, q, w, j0, j1) : dit2(x, q, w, j0, j1);
+  }
+}
+
+// All stages of a block of length len >= 4, run serially. An odd stage
+// count leaves one radix-2 stage at the largest half-length.
+template <bool Forward> void local_stages(Cx *a, size_t len) {
+  const int lg = log2_exact(len);
+  const bool odd = lg % 2;
+  if (Forward && odd)
+    dif2(a, len / 2, twiddles(lg - 1), 0, len / 2);
+  else if (!Forward)
+    dit4_unit(a, len);
+
+  // Fused pairs with q = 4, 16, ... (inverse) or the reverse (forward)
+  const int pairs = (lg - odd) / 2 - 1;
+  for (int p = 0; p < pairs; ++p) {
+    int log_q = Forward ? lg - odd - 2 * p - 2 : 2 * p + 2;
+    size_t q = (size_t)1 << log_q;
+    const Cx *w = twiddles(log_q + 1), *v = twiddles(log_q);
+    for (size_t i = 0; i < len; i += 4 * q)
+      Forward ? dif4(a + i, q, w, v, 0, q) : dit4(a + i, q, w, v, 0, q);
+  }
+
+  if (Forward)
+    dif4_unit(a, len);
+  else if (odd)
+    dit2(a, len / 2, twiddles(lg - 1), 0, len / 2);
+}
+
+template <bool Forward> void local_blocks(Cx *a, size_t n) {
+  const size_t len = n < LOCAL_LEN ? n : LOCAL_LEN;
+#pragma omp taskloop firstprivate(a, len) if (n > len)
+  for (size_t i = 0; i < n; i += len)
+    local_stages<Forward>(a + i, len);
+}
+
+// Natural order in, bit-reversed order out
+void forward(Cx *a, size_t n) {
+  const int lg = log2_exact(n);
+  const int local_lg = log2_exact(LOCAL_LEN);
+  int log_half = lg - 1;
+  if (lg > local_lg && (lg - local_lg) % 2)
+    wide_stages<true, false>(a, n, log_half--);
+  for (; log_half > local_lg; log_half -= 2)
+    wide_stages<true, true>(a, n, log_half - 1);
+  local_blocks<true>(a, n);
+}
+
+// Bit-reversed order in, natural order out, unscaled
+void inverse(Cx *a, size_t n) {
+  const int lg = log2_exact(n);
+  const int local_lg = log2_exact(LOCAL_LEN);
+  local_blocks<false>(a, n);
+  int log_q = local_lg;
+  for (; log_q + 1 < lg; log_q += 2)
+    wide_stages<false, true>(a, n, log_q);
+  if (log_q < lg)
+    wide_stages<false, false>(a, n, log_q);
+}
+
+// Balanced base-2^bits digits of |op| in (-2^(bits-1), 2^(bits-1)]: a
+// digit above half borrows 2^bits and carries one into the next. The carry
+// into a digit depends only on the nearest lower raw digit that is not
+// exactly half, so the carry into each block is found by a short backward
+// scan and the blocks can then be expanded independently.
+class BalancedDigits {
+public:
+  static constexpr size_t BLOCK = 16384;
+
+  BalancedDigits(const mpz_t op, int bits)
+      : d(mpz_limbs_read(op)), limbs(mpz_size(op)), bits(bits),
+        mask(((uint64_t)1 << bits) - 1), half((uint64_t)1 << (bits - 1)) {
+    raw_count = (mpz_sizeinbase(op, 2) + bits - 1) / bits;
+    size_t blocks = (raw_count + BLOCK - 1) / BLOCK;
+    carry_in.assign(blocks + 1, 0);
+    for (size_t k = 1; k <= blocks; ++k)
+      carry_in[k] = carry_out(k - 1);
+    count = raw_count + carry_in[blocks];
+  }
+
+  size_t size() const { return count; }
+  size_t blocks() const { return (count + BLOCK - 1) / BLOCK; }
+
+  // store(j, digit) for every digit j of block k
+  template <class Store> void expand(size_t k, Store store) const {
+    size_t j0 = k * BLOCK, j1 = std::min(j0 + BLOCK, count);
+    int64_t carry = carry_in[k];
+    for (size_t j = j0; j < j1; ++j) {
+      int64_t digit = (int64_t)(j < raw_count ? raw(j) : 0) + carry;
+      carry = digit > (int64_t)half;
+      store(j, (double)(digit - (carry << bits)));
+    }
+  }
+
+private:
+  uint64_t raw(size_t j) const {
+    size_t pos = j * bits, idx = pos / 64, off = pos % 64;
+    uint64_t w = d[idx] >> off;
+    if (off + bits > 64 && idx + 1 < limbs)
+      w |= d[idx + 1] << (64 - off);
+    return w & mask;
+  }
+
+  int carry_out(size_t k) const {
+    size_t j0 = k * BLOCK, j = std::min(j0 + BLOCK, raw_count);
+    while (j-- > j0)
+      if (raw(j) != half)
+        return raw(j) > half;
+    return carry_in[k];
+  }
+
+  const mp_limb_t *d;
+  size_t limbs;
+  int bits;
+  uint64_t mask, half;
+  size_t raw_count, count;
+  std::vector<uint8_t> carry_in; // per block, plus one for a final carry
+};
+
+// k = 0 and n/2 sit at positions 0 and 1 of the bit-reversed spectrum and
+// are their own partners; every other block [m, 2m) pairs p with 3m-1-p.
+// With Z = A + iB the product spectrum is AB = (Z_p^2 - conj(Z_q)^2) / 4i.
+void unpack_product(Cx *z, size_t n) {
+  const double inv_n = 1.0 / (double)n;
+  for (size_t p = 0; p < 2 && p < n; ++p)
+    z[p] = {z[p].re * z[p].im * inv_n, 0.0};
+
+  const double s = 0.25 * inv_n;
+  for (size_t m = 2; m < n; m <<= 1) {
+    for (size_t p = m, q = 2 * m - 1; p < q; ++p, --q) {
+      double ur = z[p].re, ui = z[p].im;
+      double vr = z[q].re, vi = -z[q].im;
+      double dr = (ur * ur - ui * ui) - (vr * vr - vi * vi);
+      double di = 2.0 * (ur * ui - vr * vi);
+      // d / 4i = (di - i dr) / 4, and the partner gets the conjugate
+      z[p] = {di * s, -dr * s};
+      z[q] = {di * s, dr * s};
+    }
+  }
+}
+
+void square_spectrum(Cx *z, size_t n) {
+  const double inv_n = 1.0 / (double)n;
+  for (size_t i = 0; i < n; ++i) {
+    double r = z[i].re, im = z[i].im;
+    z[i] = {(r * r - im * im) * inv_n, 2.0 * r * im * inv_n};
+  }
+}
+
+} // namespace
+
+double FFTMultiplier::error_bound(size_t n, double norm2) {
+  // Forward and inverse radix-2 passes contribute 3 lg(n) roundings in the
+  // additions, complex products and twiddles; the spectrum products (and
+  // unpacking the two packed operands) add two more complex multiplies.
+  const double lg = log2_exact(n);
+  double exponent = 3 * lg * std::log1p(EPS) +
+                    (3 * lg + 2) * std::log1p(EPS * std::sqrt(5.0)) +
+                    3 * lg * std::log1p(BETA);
+  return norm2 * std::expm1(exponent);
+}
+
+int FFTMultiplier::chunk_bits(size_t bits1, size_t bits2, bool square,
+                              size_t &n) {
+  for (int b = MAX_CHUNK_BITS; b >= MIN_CHUNK_BITS; --b) {
+    size_t c1 = bits1 / b + 2, c2 = bits2 / b + 2;
+    n = 1;
+    while (n < c1 + c2 - 1)
+      n <<= 1;
+    // Narrower chunks only lengthen the transform
+    if (n > ((size_t)1 << MAX_LOG_LEN))
+      return 0;
+
+    // Balanced digits are at most 2^(b-1). Packing a and b into one vector
+    // bounds both norms by |a + ib|, whose square is at most (c1 + c2)
+    // digits of that size.
+    double digit2 = std::ldexp(1.0, 2 * (b - 1));
+    double norm2 = (square ? c1 : c1 + c2) * digit2;
+    if (error_bound(n, norm2) < 0.5)
+      return b;
+  }
+  return 0;
+}
+
+bool FFTMultiplier::multiply(mpz_t rop, const mpz_t op1, const mpz_t op2) {
+  if (mpz_sgn(op1) == 0 || mpz_sgn(op2) == 0) {
+    mpz_set_ui(rop, 0);
+    return true;
+  }
+  const bool square = op1 == op2;
+  const size_t bits1 = mpz_sizeinbase(op1, 2);
+  const size_t bits2 = mpz_sizeinbase(op2, 2);
+  size_t n;
+  const int b = chunk_bits(bits1, bits2, square, n);
+  if (b == 0)
+    return false;
+
+  // op1 in the real parts, op2 in the imaginary parts, zero-padded to n
+  const BalancedDigits d1(op1, b), d2(op2, b);
+  const size_t c1 = d1.size(), c2 = square ? c1 : d2.size();
+  std::unique_ptr<Cx[]> buf(new Cx[n]);
+  Cx *z = buf.get();
+  const size_t blocks = (n + BalancedDigits::BLOCK - 1) / BalancedDigits::BLOCK;
+#pragma omp taskloop firstprivate(z, n, square) shared(d1, d2)
+  for (size_t k = 0; k < blocks; ++k) {
+    size_t j0 = k * BalancedDigits::BLOCK;
+    size_t j1 = std::min(j0 + BalancedDigits::BLOCK, n);
+    for (size_t j = j0; j < j1; ++j)
+      z[j] = {0.0, 0.0};
+    if (k < d1.blocks())
+      d1.expand(k, [z](size_t j, double v) { z[j].re = v; });
+    if (!square && k < d2.blocks())
+      d2.expand(k, [z](size_t j, double v) { z[j].im = v; });
+  }
+  const int sign = mpz_sgn(op1) * mpz_sgn(op2);
+
+  forward(z, n);
+  if (square)
+    square_spectrum(z, n);
+  else
+    unpack_product(z, n);
+  inverse(z, n);
+
+  // Round and propagate carries into b-bit digits. The bound keeps every
+  // output within 1/2 of its integer; a drift past 1/4 means the bound was
+  // violated in practice and the result is not trusted. The product has at
+  // most len + 1 digits, so any carry left after those is an error too.
+  const size_t len = c1 + c2 - 1;
+  const size_t limbs = (len * b + b - 1) / 64 + 2;
+  std::vector<mp_limb_t> out(limbs, 0);
+  const uint64_t mask = ((uint64_t)1 << b) - 1;
+  double max_err = 0.0;
+  __int128 carry = 0;
+  for (size_t j = 0; j <= len; ++j) {
+    if (j < len) {
+      double v = z[j].re, r = std::nearbyint(v);
+      max_err = std::fmax(max_err, std::fabs(v - r));
+      carry += (int64_t)r;
+    }
+    uint64_t digit = (uint64_t)carry & mask;
+    carry >>= b;
+    size_t pos = j * b, idx = pos / 64, off = pos % 64;
+    out[idx] |= digit << off;
+    if (off + b > 64)
+      out[idx + 1] |= digit >> (64 - off);
+  }
+  if (max_err > 0.25 || carry != 0)
+    return false;
+
+  mp_limb_t *d = mpz_limbs_write(rop, limbs);
+  std::memcpy(d, out.data(), limbs * sizeof(mp_limb_t));
+  mpz_limbs_finish(rop, limbs);
+  if (sign < 0)
+    mpz_neg(rop, rop);
+  return true;
+}
+
+} // namespace pi
@@ -0,0 +1,147 @@
+#include "limb_arena.hpp"
+#include "swap_space.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <gmp.h>
+
+namespace pi {
+
+namespace {
+
+constexpr size_t MIN_CLASS_BYTES = 32;
+
+// 32 bytes, then four classes per doubling up to MAX_POOLED_BYTES
+constexpr int CLASSES =
+    1 + 4 * (__builtin_ctzll(LimbArena::MAX_POOLED_BYTES) - 5);
+
+// Class of a request and the size it is rounded up to: 32 bytes, then
+// 40, 48, 56, 64, 80, 96, 112, 128, ...
+int size_class(size_t bytes, size_t &rounded) {
+  if (bytes <= MIN_CLASS_BYTES) {
+    rounded = MIN_CLASS_BYTES;
+    return 0;
+  }
+  int lg = 63 - __builtin_clzll(bytes - 1);
+  size_t quarter = (size_t)1 << (lg - 2);
+  size_t q = (bytes - 1) >> (lg - 2); // 4 .. 7
+  rounded = (q + 1) * quarter;
+  return (lg - 5) * 4 + (int)(q - 4) + 1;
+}
+
+void *checked_malloc(size_t bytes) {
+  void *p = std::malloc(bytes);
+  if (p == nullptr) {
+    std::fprintf(stderr, "GNU MP: Cannot allocate memory (size=%zu)\n",
+                 bytes);
+    std::abort();
+  }
+  return p;
+}
+
+struct FreeBlock {
+  FreeBlock *next;
+};
+
+// Free lists of one thread. Blocks come from malloc at their class size,
+// so any thread may cache a block another one allocated.
+struct ThreadPool {
+  FreeBlock *head[CLASSES] = {};
+  size_t cached = 0;
+
+  ~ThreadPool() {
+    for (FreeBlock *&h : head)
+      while (h != nullptr) {
+        FreeBlock *next = h->next;
+        std::free(h);
+        h = next;
+      }
+    destroyed = true;
+  }
+
+  // Frees arriving during thread teardown, after the pool is gone, go
+  // back to malloc
+  static thread_local bool destroyed;
+};
+
+thread_local bool ThreadPool::destroyed = false;
+thread_local ThreadPool pool;
+
+void *arena_alloc(size_t bytes) {
+  if (SwapSpace::holds(bytes))
+    return SwapSpace::allocate(bytes);
+  if (bytes > LimbArena::MAX_POOLED_BYTES)
+    return checked_malloc(bytes);
+  size_t rounded;
+  int c = size_class(bytes, rounded);
+  // Still at the class size during thread teardown: a later realloc
+  // within the class keeps the block, and any thread may cache it
+  if (ThreadPool::destroyed)
+    return checked_malloc(rounded);
+  if (FreeBlock *b = pool.head[c]) {
+    pool.head[c] = b->next;
+    pool.cached -= rounded;
+    return b;
+  }
+  return checked_malloc(rounded);
+}
+
+void arena_free(void *p, size_t bytes) {
+  if (SwapSpace::holds(bytes)) {
+    SwapSpace::release(p, bytes);
+    return;
+  }
+  if (bytes > LimbArena::MAX_POOLED_BYTES || ThreadPool::destroyed) {
+    std::free(p);
+    return;
+  }
+  size_t rounded;
+  int c = size_class(bytes, rounded);
+  if (pool.cached + rounded > LimbArena::MAX_CACHED_BYTES) {
+    std::free(p);
+    return;
+  }
+  FreeBlock *b = static_cast<FreeBlock *>(p);
+  b->next = pool.head[c];
+  pool.head[c] = b;
+  pool.cached += rounded;
+}
+
+void *arena_realloc(void *p, size_t old_bytes, size_t new_bytes) {
+  const size_t max = LimbArena::MAX_POOLED_BYTES;
+  const bool old_swapped = SwapSpace::holds(old_bytes);
+  if (old_swapped && SwapSpace::holds(new_bytes))
+    return SwapSpace::reallocate(p, old_bytes, new_bytes);
+  if (old_bytes > max && new_bytes > max && !old_swapped &&
+      !SwapSpace::holds(new_bytes)) {
+    void *q = std::realloc(p, new_bytes);
+    if (q == nullptr) {
+      std::fprintf(stderr, "GNU MP: Cannot reallocate memory (size=%zu)\n",
+                   new_bytes);
+      std::abort();
+    }
+    return q;
+  }
+  if (old_bytes <= max && new_bytes <= max) {
+    size_t old_rounded, new_rounded;
+    if (size_class(old_bytes, old_rounded) ==
+        size_class(new_bytes, new_rounded))
+      return p;
+  }
+  void *q = arena_alloc(new_bytes);
+  std::memcpy(q, p, old_bytes < new_bytes ? old_bytes : new_bytes);
+  arena_free(p, old_bytes);
+  return q;
+}
+
+} // namespace
+
+void LimbArena::install() {
+  mp_set_memory_functions(arena_alloc, arena_realloc, arena_free);
+}
+
+void *LimbArena::allocate(size_t bytes) { return arena_alloc(bytes); }
+
+void LimbArena::release(void *p, size_t bytes) { arena_free(p, bytes); }
+
+} // namespace pi
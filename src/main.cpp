@@ -1,6 +1,13 @@
 #include "base_conv.hpp"
 #include "bigint.hpp"
+#include "checkpoint.hpp"
+#include "chudnovsky.hpp"
+#include "digit_output.hpp"
+#include "limb_arena.hpp"
+#include "memory_plan.hpp"
 #include "ntt.hpp"
+#include "progress.hpp"
+#include "swap_space.hpp"
 #include "timer.hpp"
 #include "validator.hpp"
 #include <algorithm>
@@ -10,6 +17,7 @@
 #include <ctime>
 #include <gmp.h>
 #include <iostream>
+#include <memory>
 #include <omp.h>
 #include <string>
 #include <utility>
@@ -27,6 +35,7 @@ using namespace pi;
 #include <ctime>
 #include <iomanip>
 #include <fstream>
+#include <functional>
 #include <sstream>
 
 using namespace pi;
@@ -34,7 +43,6 @@ using namespace pi;
 void log_event(const Timer &timer, const char *event) {
   printf("\n%.3f\t%s\n", timer.elapsed_seconds(), event);
   fflush(stdout);
-  ev_list.push_back({t, event});
 }
 
 // Helper to get formatted current time
@@ -48,7 +56,10 @@ std::string get_timestamp() {
 void write_validation_report(int64_t digits, double comp_time, double wall_time,
                              double user_util, double kernel_util,
                              const std::vector<std::pair<std::string, double>>& events,
-                             const char* result_str, size_t actual_len) {
+                             const std::function<char(int64_t)>& result_str,
+                             size_t actual_len, int64_t shown_digits,
+                             const char* radix,
+                             const std::vector<HexCheck>& hex_checks) {
   time_t now = time(0);
   tm* ltm = localtime(&now);
   char timestamp[20];
@@ -68,7 +79,7 @@ void write_validation_report(int64_t digits, double comp_time, double wall_time,
   f << "Total Computation Time:    " << std::fixed << std::setprecision(3) << comp_time << " seconds\n";
   f << "Start-to-End Wall Time:    " << wall_time << " seconds\n";
   f << "CPU Utilization:           " << user_util << " %  +  " << kernel_util << " % kernel overhead\n\n";
-  f << "Final String Length:       " << actual_len << " (Expected " << digits + 1 << ")\n\n";
+  f << "Final String Length:       " << actual_len << " (Expected " << shown_digits + 1 << ")\n\n";
 
   f << "Event Log:\n";
   for (const auto& ev : events) {
@@ -76,16 +87,16 @@ void write_validation_report(int64_t digits, double comp_time, double wall_time,
   }
   f << "\n";
 
-  f << "Decimal Digits Samples:\n";
+  f << radix << " Digits Samples:\n";
   // Sample at point s: show 50 digits ending at position s
   std::vector<int64_t> samples = {50, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000};
   for (int64_t s : samples) {
-    if (s <= digits && (size_t)s < actual_len) {
+    if (s <= shown_digits && (size_t)s < actual_len) {
         f << std::setw(12) << std::left << (s == 50 ? "3. 51" : std::to_string(s)) << ":  ";
         for (int i = 0; i < 50; ++i) {
             if (i > 0 && i % 10 == 0) f << " ";
             int64_t idx = s - 50 + 1 + i; 
-            if (idx < (int64_t)actual_len) f << result_str[idx];
+            if (idx < (int64_t)actual_len) f << result_str(idx);
             else f << "?";
         }
         f << "\n";
@@ -97,18 +108,54 @@ void write_validation_report(int64_t digits, double comp_time, double wall_time,
       for (int i = 0; i < 50; ++i) {
           if (i > 0 && i % 10 == 0) f << " ";
           int64_t idx = actual_len - 51 + i;
-          if (idx >= 0) f << result_str[idx];
+          if (idx >= 0) f << result_str(idx);
       }
       f << "\n";
   }
 
   f << "\n-----------------------------------------------------------\n";
-  f << "Validation Status: Spot Check Recommended with y-cruncher logs.\n";
+  if (hex_checks.empty()) {
+    f << "Validation Status: Spot Check Recommended (--verify checks hex digits by BBP).\n";
+  } else {
+    // Only a run whose checks all matched gets this far
+    f << "BBP Hex Digits (matched Bellard's formula):\n";
+    for (const HexCheck& check : hex_checks) {
+      f << std::setw(12) << std::left << check.position + 1 << ":  " << check.actual << "\n";
+    }
+    f << "\nValidation Status: Verified by hex digit extraction.\n";
+  }
   f.close();
   
   std::cout << "Validation report saved to: " << filename << std::endl;
 }
 
+// Decimal text, hexadecimal text, or decimal packed 19 digits to a word
+enum class OutputFormat { Text, Hex, Packed };
+
+// Room ahead of the words in every .ycd file
+constexpr size_t YCD_HEADER_BYTES = 4096;
+
+// The header of block block_id of a packed decimal file, after the .ycd
+// files of y-cruncher: text lines, then a NUL after which the
+// little-endian words of the block begin. Spaces pad it so that the NUL is
+// the last byte of the room, leaving the words page-aligned in the file.
+std::string ycd_header(const std::string &first_digits, int64_t total_digits,
+                       int64_t block_digits, size_t block_id, size_t room) {
+  std::ostringstream h;
+  h << "#Compressed Digit File\n\n"
+    << "FileVersion:\t1.1.0\n\n"
+    << "Base:\t10\n\n"
+    << "FirstDigits:\t" << first_digits << "\n\n"
+    << "TotalDigits:\t" << total_digits << "\n\n"
+    << "Blocksize:\t" << block_digits << "\n"
+    << "BlockID:\t" << block_id << "\n\n"
+    << "EndHeader\n\n";
+  std::string text = h.str();
+  text.resize(room - 1, ' ');
+  text += '\0';
+  return text;
+}
+
 int64_t parse_digits(std::string arg) {
   if (arg.empty())
     return 1000;
@@ -161,11 +208,125 @@ CPUMetrics get_cpu_metrics() {
   return {0, 0};
 }
 
+// Times GMP, the NTT engine and the FP FFT engine on random operands of
+// growing size (best of three runs each) and checks both engines against
+// mpz_mul.
+void run_mul_benchmark() {
+  const MulPolicy policy = MulPolicy::current();
+  const MulPolicy ntt = policy.with_engine(MulEngine::NTT);
+  const MulPolicy fft = policy.with_engine(MulEngine::FFT);
+  gmp_randstate_t rng;
+  gmp_randinit_default(rng);
+  mpz_t a, b, expected, r;
+  mpz_inits(a, b, expected, r, NULL);
+
+  auto best_of = [&](auto &&fn) {
+    double best = 1e300;
+    for (int i = 0; i < 3; ++i) {
+      Timer t;
+      fn();
+      best = std::min(best, t.elapsed_seconds());
+    }
+    return best;
+  };
+
+  printf("Threads: %d\n", omp_get_max_threads());
+  printf("%12s %10s %10s %10s %10s %10s\n", "bits", "gmp", "ntt", "fft",
+         "ntt sqr", "fft sqr");
+  for (size_t bits = 1000000; bits <= 32000000; bits *= 2) {
+    mpz_urandomb(a, rng, bits);
+    mpz_urandomb(b, rng, bits);
+    double t_gmp = best_of([&] { mpz_mul(expected, a, b); });
+    double t_ntt = best_of([&] { NTTMultiplier::multiply(r, a, b, ntt); });
+    bool ok = mpz_cmp(r, expected) == 0;
+    double t_fft = best_of([&] { NTTMultiplier::multiply(r, a, b, fft); });
+    ok = ok && mpz_cmp(r, expected) == 0;
+
+    mpz_mul(expected, a, a);
+    double t_ntt_sqr = best_of([&] { NTTMultiplier::square(r, a, ntt); });
+    ok = ok && mpz_cmp(r, expected) == 0;
+    double t_fft_sqr = best_of([&] { NTTMultiplier::square(r, a, fft); });
+    ok = ok && mpz_cmp(r, expected) == 0;
+
+    printf("%12zu %10.4f %10.4f %10.4f %10.4f %10.4f%s\n", bits, t_gmp, t_ntt,
+           t_fft, t_ntt_sqr, t_fft_sqr, ok ? "" : "  MISMATCH");
+  }
+
+  mpz_clears(a, b, expected, r, NULL);
+  gmp_randclear(rng);
+}
+
 int main(int argc, char *argv[]) {
+  LimbArena::install();
   omp_set_max_active_levels(3);
+  if (argc > 1 && std::strcmp(argv[1], "--bench-mul") == 0) {
+    run_mul_benchmark();
+    return 0;
+  }
+  if (argc > 1 && std::strcmp(argv[1], "--tune") == 0) {
+    TuningProfile profile = TuningProfile::tune();
+    if (!profile.save(TuningProfile::DEFAULT_PATH)) {
+      std::cerr << "Cannot write " << TuningProfile::DEFAULT_PATH << std::endl;
+      return 1;
+    }
+    std::cout << "Tuning profile written to " << TuningProfile::DEFAULT_PATH
+              << std::endl;
+    return 0;
+  }
+
   int64_t digits = 1000;
-  if (argc > 1)
-    digits = parse_digits(argv[1]);
+  bool reduce_gcd = false, resume = false, verify = false;
+  std::string swap_dir, checkpoint_dir;
+  size_t max_memory = 0, shard_bytes = 0;
+  OutputFormat format = OutputFormat::Text;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--gcd") == 0) {
+      reduce_gcd = true;
+    } else if (std::strcmp(argv[i], "--verify") == 0) {
+      verify = true;
+    } else if (std::strcmp(argv[i], "--swap") == 0 && i + 1 < argc) {
+      swap_dir = argv[++i];
+    } else if (std::strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+      checkpoint_dir = argv[++i];
+    } else if (std::strcmp(argv[i], "--resume") == 0) {
+      resume = true;
+    } else if (std::strcmp(argv[i], "--max-memory") == 0 && i + 1 < argc) {
+      if (!MemoryPlan::parse_size(argv[++i], max_memory)) {
+        std::cerr << "Invalid --max-memory size " << argv[i] << std::endl;
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "--shard") == 0 && i + 1 < argc) {
+      if (!MemoryPlan::parse_size(argv[++i], shard_bytes) || shard_bytes == 0) {
+        std::cerr << "Invalid --shard size " << argv[i] << std::endl;
+        return 1;
+      }
+    } else if (std::strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+      const std::string name = argv[++i];
+      if (name == "txt") {
+        format = OutputFormat::Text;
+      } else if (name == "hex") {
+        format = OutputFormat::Hex;
+      } else if (name == "ycd") {
+        format = OutputFormat::Packed;
+      } else {
+        std::cerr << "Unknown --format " << name << " (txt, hex or ycd)"
+                  << std::endl;
+        return 1;
+      }
+    } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+      std::cerr << "Unknown option " << argv[i] << std::endl;
+      return 1;
+    } else {
+      digits = parse_digits(argv[i]);
+    }
+  }
+  if (!swap_dir.empty() && !SwapSpace::enable(swap_dir))
+    return 1;
+  if (resume && checkpoint_dir.empty())
+    checkpoint_dir = Checkpoint::DEFAULT_DIR;
+  std::unique_ptr<Checkpoint> checkpoint;
+  if (!checkpoint_dir.empty())
+    checkpoint.reset(new Checkpoint(checkpoint_dir, digits, resume));
 
   Timer total_timer;
   std::vector<std::pair<std::string, double>> event_history;
@@ -180,11 +341,55 @@ int main(int argc, char *argv[]) {
 
   int64_t iterations = (double)digits / 14.181647 + 200;
   int64_t guard = 256;
+  // Fraction bits of pi through Step 2: the digits and the guard digits
+  const size_t frac_bits =
+      (size_t)std::ceil((digits + guard) * 3.32192809488736235);
 
   std::cout << "Program:               Pi-Calc (Version 3.0)"
             << std::endl;
   std::cout << "Algorithm:             Chudnovsky (1988)" << std::endl;
   std::cout << "Decimal Digits:        " << digits << std::endl;
+  const bool tuned = !TuningProfile::startup().empty();
+  std::cout << "Tuning Profile:        "
+            << (tuned ? TuningProfile::DEFAULT_PATH : "built-in defaults")
+            << std::endl;
+  std::cout << "Swap Directory:        ";
+  if (SwapSpace::enabled())
+    std::cout << swap_dir << " (blocks of " << (SwapSpace::min_bytes() >> 20)
+              << " MiB and up)" << std::endl;
+  else
+    std::cout << "none (in memory)" << std::endl;
+  std::cout << "Checkpoints:           "
+            << (checkpoint ? checkpoint_dir + (resume ? " (resuming)" : "")
+                           : std::string("off"))
+            << std::endl;
+  const char *output_path = format == OutputFormat::Hex      ? "pi_hex.txt"
+                            : format == OutputFormat::Packed ? "pi.ycd"
+                                                             : "pi.txt";
+  std::cout << "Output:                " << output_path;
+  if (shard_bytes != 0)
+    std::cout << " in shards of " << MemoryPlan::format_size(shard_bytes);
+  std::cout << std::endl;
+  std::cout << "Common Factors:        "
+            << (reduce_gcd ? "removed (sieve)" : "kept") << std::endl;
+  std::cout << "Verification:          "
+            << (verify ? "BBP hex digits at 3 positions" : "off") << std::endl;
+
+  // Refused here rather than hours in, when the cap cannot be met
+  const MemoryPlan plan = MemoryPlan::choose(digits, omp_get_max_threads(),
+                                             reduce_gcd, max_memory);
+  plan.print(std::cout, max_memory);
+  if (!plan.fits(max_memory)) {
+    std::cerr << "No plan fits " << digits << " digits into "
+              << MemoryPlan::format_size(max_memory)
+              << "; raise --max-memory or add --swap" << std::endl;
+    return 1;
+  }
+  // Each phase runs with the team the plan gave it
+  const int max_threads = omp_get_max_threads();
+  auto use_threads = [max_threads](int threads) {
+    omp_set_num_threads(std::min(threads, max_threads));
+  };
   std::cout << "-----------------------------------------------" << std::endl;
 
   std::cout << "Event Log:" << std::endl;
@@ -192,60 +397,187 @@ int main(int argc, char *argv[]) {
   Timer comp_timer;
 
   BigInt P, Q, T;
-  record_event("Step 1: Binary Splitting Start");
-#pragma omp parallel
-  {
-#pragma omp single
-    BigInt::binary_split(0, iterations, P, Q, T);
-  }
-  std::cout << std::endl;
-  record_event("Step 1: Binary Splitting Finished");
-  
-  NTTMultiplier::use_hybrid = true; // Switch to multi-core strategy for Step 2
-  record_event("Step 2: Evaluation (Parallel)");
-  
   mpz_t pi_z, num, sqrt_val, d10;
   mpz_init(pi_z);
   mpz_init(num);
   mpz_init(sqrt_val);
   mpz_init(d10);
 
-  record_event("Step 2.1: Power of 10 Start");
-  mpz_ui_pow_ui(d10, 10, 2 * (digits + guard));
-  mpz_mul_ui(d10, d10, 10005);
-  record_event("Step 2.1: Power of 10 Finished");
-
-  record_event("Step 2.2: Square Root Start");
-  BigInt::parallel_sqrt(sqrt_val, d10);
-  record_event("Step 2.2: Square Root Finished");
+  // On --resume the latest phase found on disk decides where to start;
+  // the saved subtrees of Step 1 are picked up inside the series
+  const bool have_pi = checkpoint && checkpoint->load("quotient", {pi_z});
+  const bool have_series =
+      have_pi || (checkpoint && checkpoint->load("series", {Q.value, T.value}));
+  const bool have_sqrt =
+      have_pi || (checkpoint && checkpoint->load("sqrt", {sqrt_val}));
+
+  if (have_series) {
+    record_event("Step 1: Binary Splitting Resumed from Checkpoint");
+  } else {
+    record_event("Step 1: Binary Splitting Start");
+    ChudnovskySeries series(iterations, reduce_gcd);
+    series.checkpoint_to(checkpoint.get());
+    series.set_granularity(plan.series_task_terms, plan.merge_breadth);
+    use_threads(plan.series_threads);
+    {
+      ProgressSampler progress([&] { return series.completed(); },
+                               iterations, "Step 1 Progress", "terms");
+      series.compute(P, Q, T);
+    }
+    std::cout << std::endl;
+    P.clear(); // only Q and T are used from here on
+    if (checkpoint && checkpoint->save("series", {Q.value, T.value}))
+      checkpoint->remove_all("split_");
+    record_event("Step 1: Binary Splitting Finished");
+  }
 
-  record_event("Step 2.3: Multiplier Start");
-  NTTMultiplier::multiply(num, Q.value, sqrt_val);
-  mpz_mul_ui(num, num, 426880);
-  record_event("Step 2.3: Multiplier Finished");
+  record_event("Step 2: Evaluation (Parallel)");
+  use_threads(plan.evaluation_threads);
+
+  if (!have_sqrt) {
+    // sqrt(10005) in binary fixed point; Step 3 reads the decimals off the
+    // binary quotient, so no power of ten enters Step 2
+    record_event("Step 2.1: Square Root Start");
+    BigInt::parallel_sqrt_ui(sqrt_val, 10005, frac_bits);
+    if (checkpoint)
+      checkpoint->save("sqrt", {sqrt_val});
+    record_event("Step 2.1: Square Root Finished");
+  }
 
-  record_event("Step 2.4: Final Division Start");
-  BigInt::parallel_div(pi_z, num, T.value);
-  
-  mpz_ui_pow_ui(d10, 10, guard);
-  mpz_tdiv_q(pi_z, pi_z, d10);
-  record_event("Step 2.4: Final Division Finished");
+  if (have_pi) {
+    record_event("Step 2.3: Final Division Resumed from Checkpoint");
+  } else {
+    record_event("Step 2.2: Multiplier Start");
+    NTTMultiplier::multiply(num, Q.value, sqrt_val);
+    mpz_mul_ui(num, num, 426880);
+    Q.clear();
+    mpz_realloc2(sqrt_val, 0);
+    record_event("Step 2.2: Multiplier Finished");
+
+    record_event("Step 2.3: Final Division Start");
+    // pi * 2^frac_bits, with two integer bits
+    BigInt::parallel_div(pi_z, num, T.value, frac_bits + 2);
+    T.clear();
+    mpz_realloc2(num, 0);
+    if (checkpoint && checkpoint->save("quotient", {pi_z})) {
+      checkpoint->remove("series");
+      checkpoint->remove("sqrt");
+    }
+    record_event("Step 2.3: Final Division Finished");
+  }
 
   record_event("Step 2: Evaluation Finished");
 
   double computation_time = comp_timer.elapsed_seconds();
 
+  // With --verify, a few windows of hex digits of the quotient against
+  // Bellard's formula, which extracts them without any of the digits
+  // before: a run that went wrong anywhere stops here rather than writing
+  // its digits. The formula's work grows with the position checked, so
+  // this costs a sizeable fraction of the computation; it is opt-in.
+  const int64_t hex_digits = (int64_t)(digits * 3.32192809488736235 / 4);
+  std::vector<HexCheck> hex_checks;
+  if (verify) {
+    record_event("Verification: BBP Hex Digits Start");
+    use_threads(max_threads);
+    hex_checks = PiValidator::check_hex(pi_z, frac_bits, hex_digits);
+    for (const HexCheck &check : hex_checks) {
+      std::cout << "BBP Hex Check:         digits " << check.position + 1
+                << "+ " << check.actual
+                << (check.passed ? " (match)"
+                                 : " (MISMATCH, formula gives " +
+                                       check.expected + ")")
+                << std::endl;
+      if (!check.passed) {
+        std::cerr << "Verification failed; no digits written" << std::endl;
+        mpz_clears(pi_z, num, sqrt_val, d10, NULL);
+        return 1;
+      }
+    }
+    record_event("Verification: BBP Hex Digits Finished");
+  }
+
   record_event("Step 3: Conversion & Writing Start");
-  char *result_str = new char[digits + 5];
-  BaseConverter::parallel_to_str(pi_z, digits + 1, result_str);
-  size_t actual_len = digits + 1;
-
-  FILE *f = fopen("pi.txt", "w");
-  if (f) {
-    fprintf(f, "%c.", result_str[0]);
-    fwrite(result_str + 1, 1, digits, f);
-    fclose(f);
+  use_threads(plan.conversion_threads);
+  mpz_tdiv_q_2exp(d10, pi_z, frac_bits);
+  const unsigned long integer_part = mpz_get_ui(d10);
+  // Decimals the truncated remainder tree cannot settle, because one of
+  // them sits too close to a digit boundary: the integer pi * 10^digits,
+  // less its leading digit, split exactly
+  auto exact_decimals = [&](char *out) {
+    record_event("Step 3: Ambiguous Digits, Decimal Scaling");
+    BigInt::parallel_pow_ui(d10, 10, digits);
+    // Only the integer part of the product is formed, with a guard limb
+    // below it to absorb the carry the high product leaves out
+    NTTMultiplier::multiply_high(pi_z, pi_z, d10, frac_bits - GMP_NUMB_BITS);
+    mpz_tdiv_q_2exp(pi_z, pi_z, GMP_NUMB_BITS);
+    mpz_submul_ui(pi_z, d10, integer_part);
+    mpz_realloc2(d10, 0);
+    BaseConverter::parallel_to_str(pi_z, digits, out,
+                                   plan.convert_task_digits);
+  };
+
+  // The converters write into the mapped output files themselves. The
+  // report reads digit idx of the leading digit and those after the point
+  // through digit_at.
+  DigitOutput output;
+  int64_t shown_digits = digits;
+  const char *radix = "Decimal";
+  std::function<char(int64_t)> digit_at;
+  if (format == OutputFormat::Hex) {
+    // pi * 2^frac_bits is binary already: no conversion at all
+    shown_digits = hex_digits;
+    radix = "Hexadecimal";
+    if (!output.open(output_path, shown_digits + 2, shard_bytes))
+      return 1;
+    char *text = output.data();
+    text[0] = "0123456789abcdef"[integer_part];
+    text[1] = '.';
+    BaseConverter::fraction_to_hex(pi_z, frac_bits, shown_digits, text + 2);
+    digit_at = [text](int64_t idx) { return text[idx == 0 ? 0 : idx + 1]; };
+  } else if (format == OutputFormat::Packed) {
+    const int64_t words = (digits + 18) / 19;
+    if (!output.open(output_path, words * sizeof(uint64_t), shard_bytes,
+                     YCD_HEADER_BYTES))
+      return 1;
+    uint64_t *packed = reinterpret_cast<uint64_t *>(output.data());
+    if (!BaseConverter::fraction_to_words(pi_z, frac_bits, digits, packed,
+                                          plan.convert_task_digits)) {
+      char *text = static_cast<char *>(LimbArena::allocate(digits));
+      exact_decimals(text);
+      BaseConverter::pack_words(text, digits, packed);
+      LimbArena::release(text, digits);
+    }
+    digit_at = [packed, integer_part](int64_t idx) {
+      if (idx == 0)
+        return (char)('0' + integer_part);
+      uint64_t word = packed[(idx - 1) / 19];
+      for (int64_t k = 18 - (idx - 1) % 19; k > 0; --k)
+        word /= 10;
+      return (char)('0' + word % 10);
+    };
+    std::string first = "3.";
+    for (int64_t i = 1; i <= std::min<int64_t>(50, digits); ++i)
+      first += digit_at(i);
+    const int64_t block_digits =
+        (int64_t)(output.shard_length() / sizeof(uint64_t)) * 19;
+    for (size_t i = 0; i < output.files().size(); ++i)
+      output.set_header(i, ycd_header(first, digits, block_digits, i,
+                                      output.header_length()));
+  } else {
+    if (!output.open(output_path, digits + 2, shard_bytes))
+      return 1;
+    char *text = output.data();
+    // The leading 3 is the integer part; the decimals come straight from
+    // the binary fraction
+    text[0] = (char)('0' + integer_part);
+    text[1] = '.';
+    if (!BaseConverter::fraction_to_str(pi_z, frac_bits, digits, text + 2,
+                                        plan.convert_task_digits))
+      exact_decimals(text + 2);
+    digit_at = [text](int64_t idx) { return text[idx == 0 ? 0 : idx + 1]; };
   }
+  size_t actual_len = shown_digits + 1;
   record_event("Step 3: Conversion & Writing Finished");
   record_event("End Computation");
 
@@ -267,9 +599,16 @@ int main(int argc, char *argv[]) {
   std::cout << "-----------------------------------------------" << std::endl;
 
   // Generate the professional validation report
-  write_validation_report(digits, computation_time, wall_time, user_util, kernel_util, event_history, result_str, actual_len);
+  write_validation_report(digits, computation_time, wall_time, user_util, kernel_util, event_history, digit_at, actual_len, shown_digits, radix, hex_checks);
 
-  delete[] result_str;
+  // Renamed into place only now that every digit is in
+  if (!output.close()) {
+    std::cerr << "Cannot write " << output.files().front() << std::endl;
+    mpz_clears(pi_z, num, sqrt_val, d10, NULL);
+    return 1;
+  }
+  if (checkpoint)
+    checkpoint->remove("quotient"); // the digits are out; nothing to resume
   mpz_clears(pi_z, num, sqrt_val, d10, NULL);
   return 0;
 }
@@ -0,0 +1,242 @@
+#include "memory_plan.hpp"
+#include "base_conv.hpp"
+#include "chudnovsky.hpp"
+#include "digit_output.hpp"
+#include "mul_policy.hpp"
+#include "ntt.hpp"
+#include "swap_space.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <ostream>
+#include <vector>
+
+namespace pi {
+
+namespace {
+
+constexpr double BITS_PER_DIGIT = 3.32192809488736235;
+
+// Allocator slack, the limb pools and the NTT root tables, on top of
+// what the phases hold
+constexpr size_t BASE_BYTES = (size_t)64 << 20;
+
+// Common-factor removal leaves about 60% of P, Q and T
+constexpr double GCD_SHRINK = 0.6;
+
+// An integer of the given size counts unless swap mode keeps it on disk
+size_t in_ram(double bytes) {
+  size_t b = (size_t)bytes;
+  return SwapSpace::holds(b) ? 0 : b;
+}
+
+// Sizes of the series at the root, after common-factor removal if any
+struct SeriesSize {
+  int64_t terms;
+  size_t p_bits, q_bits, t_bits;
+  double shrink;
+
+  SeriesSize(int64_t digits, bool reduce_gcd)
+      : terms((int64_t)((double)digits / 14.181647 + 200)),
+        shrink(reduce_gcd ? GCD_SHRINK : 1.0) {
+    ChudnovskySeries::bound_bits(0, terms, p_bits, q_bits, t_bits);
+  }
+
+  double bytes(size_t bits) const { return bits / 8.0 * shrink; }
+};
+
+// Step 1. At the root merge the halves (about P + Q + T together), the
+// outputs and the second T product are live while merge_breadth products
+// share the team. Before that each thread works through one serial
+// subtree of up to task_terms terms while the finished ones wait for their
+// siblings; the sieve of --gcd stays throughout.
+size_t series_bytes(const SeriesSize &s, bool reduce_gcd, int threads,
+                    int breadth, int64_t task_terms) {
+  const MulPolicy policy = TuningProfile::startup().for_threads(threads);
+  const double P = s.bytes(s.p_bits), Q = s.bytes(s.q_bits),
+               T = s.bytes(s.t_bits);
+
+  // A thread works on one product at a time, so no more than `threads`
+  // of them are in flight, sharing the team between them
+  const int in_flight = std::min(threads, breadth);
+  const size_t product_ws = NTTMultiplier::workspace_bytes(
+      (size_t)(s.t_bits * s.shrink / 2), (size_t)(s.q_bits * s.shrink / 2),
+      threads / in_flight, policy);
+  const size_t root = 2 * in_ram(P / 2) + 2 * in_ram(Q / 2) +
+                      2 * in_ram(T / 2) + in_ram(P) + in_ram(Q) +
+                      2 * in_ram(T) + in_flight * product_ws;
+
+  size_t sp, sq, st;
+  ChudnovskySeries::bound_bits(s.terms - std::min(task_terms, s.terms),
+                               s.terms, sp, sq, st);
+  const size_t subtrees =
+      in_ram(P + Q + T) + threads * (size_t)(4 * s.bytes(sp + sq + st));
+  const size_t sieve = reduce_gcd ? 4 * (size_t)s.terms : 0;
+  return std::max(root, subtrees) + sieve;
+}
+
+// Step 2. The square root of 10005 is built at the output size S from
+// half-size products; the multiplier holds Q, T, the root and Q * root;
+// the division, with Q released, T, the numerator, their leading bits cut
+// to the output size, the reciprocal and its product.
+size_t evaluation_bytes(const SeriesSize &s, int64_t digits, int threads) {
+  const MulPolicy policy = TuningProfile::startup().for_threads(threads);
+  const double S = digits * BITS_PER_DIGIT / 8;
+  const double Q = s.bytes(s.q_bits), T = s.bytes(s.t_bits);
+  const double num = Q + S;
+  const size_t sqrt_peak =
+      3 * in_ram(S) + in_ram(S / 2) +
+      NTTMultiplier::workspace_bytes((size_t)(4 * S), (size_t)(4 * S),
+                                     threads, policy);
+  const size_t mult_peak =
+      in_ram(Q) + in_ram(T) + in_ram(S) + in_ram(num) +
+      NTTMultiplier::workspace_bytes((size_t)(8 * Q), (size_t)(8 * S),
+                                     threads, policy);
+  const size_t div_peak =
+      in_ram(T) + in_ram(num) + 3 * in_ram(S) + in_ram(2 * S) +
+      NTTMultiplier::workspace_bytes((size_t)(8 * S), (size_t)(8 * S),
+                                     threads, policy);
+  return std::max({sqrt_peak, mult_peak, div_peak});
+}
+
+// Step 3: pi, the decimal string unless it is a mapping of the output
+// file, the power table (each power of ten
+// about halves the one before, so about pi again, plus the neighbours of
+// odd halves) and, at the root of the remainder tree, its fraction, the
+// two halves and the middle product's workspace. The rare exact fallback
+// first holds 10^digits and the high product of the decimal scaling, then
+// splits by division much like the tree.
+size_t conversion_bytes(int64_t digits, int threads) {
+  const MulPolicy policy = TuningProfile::startup().for_threads(threads);
+  const double S = digits * BITS_PER_DIGIT / 8;
+  const size_t power_table = 3 * in_ram(S / 2);
+  const size_t squaring = NTTMultiplier::workspace_bytes(
+      (size_t)(4 * S), (size_t)(4 * S), threads, policy);
+  const size_t tree = 2 * in_ram(S) +
+                      NTTMultiplier::workspace_bytes(
+                          (size_t)(8 * S), (size_t)(4 * S), threads, policy);
+  const size_t scaling =
+      in_ram(S) + in_ram(2 * S) +
+      NTTMultiplier::workspace_bytes((size_t)(8 * S), (size_t)(8 * S),
+                                     threads, policy);
+  const size_t text = DigitOutput::MAPPED ? 0 : in_ram((double)digits);
+  return in_ram(S) + text + power_table +
+         std::max({squaring, tree, scaling});
+}
+
+size_t with_base(size_t bytes) { return bytes + BASE_BYTES; }
+
+} // namespace
+
+size_t MemoryPlan::peak() const {
+  return std::max({step1, step2, step3});
+}
+
+MemoryPlan MemoryPlan::choose(int64_t digits, int threads, bool reduce_gcd,
+                              size_t max_bytes) {
+  const SeriesSize series(digits, reduce_gcd);
+  auto fits = [&](size_t bytes) { return max_bytes == 0 || bytes <= max_bytes; };
+  std::vector<int> teams;
+  for (int t = std::max(1, threads);; t = (t + 1) / 2) {
+    teams.push_back(t);
+    if (t == 1)
+      break;
+  }
+
+  struct Granularity {
+    int breadth;
+    int64_t task_terms;
+  };
+  const Granularity steps[] = {
+      {ChudnovskySeries::MERGE_BREADTH, ChudnovskySeries::TASK_MIN_TERMS},
+      {2, ChudnovskySeries::TASK_MIN_TERMS},
+      {1, ChudnovskySeries::TASK_MIN_TERMS},
+      {1, ChudnovskySeries::TASK_MIN_TERMS / 4}};
+
+  MemoryPlan plan;
+  plan.convert_task_digits = BaseConverter::TASK_MIN_DIGITS;
+  [&] {
+    for (int t : teams)
+      for (const Granularity &g : steps) {
+        plan.series_threads = t;
+        plan.merge_breadth = g.breadth;
+        plan.series_task_terms = g.task_terms;
+        plan.step1 = with_base(
+            series_bytes(series, reduce_gcd, t, g.breadth, g.task_terms));
+        if (fits(plan.step1))
+          return;
+      }
+  }();
+  for (int t : teams) {
+    plan.evaluation_threads = t;
+    plan.step2 = with_base(evaluation_bytes(series, digits, t));
+    if (fits(plan.step2))
+      break;
+  }
+  for (int t : teams) {
+    plan.conversion_threads = t;
+    plan.step3 = with_base(conversion_bytes(digits, t));
+    if (fits(plan.step3))
+      break;
+  }
+  return plan;
+}
+
+void MemoryPlan::print(std::ostream &os, size_t max_bytes) const {
+  os << "Memory Plan:           estimated peak " << format_size(peak());
+  if (max_bytes != 0)
+    os << " of " << format_size(max_bytes) << " allowed";
+  os << "\n  Step 1 (series):     " << format_size(step1) << "  "
+     << series_threads << " threads, tasks above " << series_task_terms
+     << " terms, " << merge_breadth << " products per merge"
+     << "\n  Step 2 (evaluation): " << format_size(step2) << "  "
+     << evaluation_threads << " threads"
+     << "\n  Step 3 (conversion): " << format_size(step3) << "  "
+     << conversion_threads << " threads, tasks above " << convert_task_digits
+     << " digits (fixed)\n";
+}
+
+bool MemoryPlan::parse_size(const std::string &s, size_t &bytes) {
+  if (s.empty())
+    return false;
+  size_t end = 0;
+  double value;
+  try {
+    value = std::stod(s, &end);
+  } catch (...) {
+    return false;
+  }
+  int shift = 0;
+  if (end < s.size()) {
+    switch (std::toupper((unsigned char)s[end])) {
+    case 'K': shift = 10; break;
+    case 'M': shift = 20; break;
+    case 'G': shift = 30; break;
+    case 'T': shift = 40; break;
+    default: return false;
+    }
+    ++end;
+    if (end < s.size() && std::toupper((unsigned char)s[end]) == 'B')
+      ++end; // "200GB"
+  }
+  if (end != s.size() || !(value > 0))
+    return false;
+  bytes = (size_t)std::ldexp(value, shift);
+  return true;
+}
+
+std::string MemoryPlan::format_size(size_t bytes) {
+  const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+  double v = (double)bytes;
+  int u = 0;
+  while (v >= 1024 && u < 4) {
+    v /= 1024;
+    ++u;
+  }
+  char buf[32];
+  std::snprintf(buf, sizeof buf, u == 0 ? "%.0f %s" : "%.2f %s", v, units[u]);
+  return buf;
+}
+
+} // namespace pi
@@ -0,0 +1,276 @@
+#include "mul_policy.hpp"
+#include "ntt.hpp"
+#include "timer.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <gmp.h>
+#include <iostream>
+#include <omp.h>
+#include <sstream>
+
+namespace pi {
+
+MulPolicy MulPolicy::defaults(int threads) {
+  MulPolicy p;
+  if (threads <= 1)
+    p.parallel_min_bits = NEVER;
+  return p;
+}
+
+MulPolicy MulPolicy::current() {
+  return TuningProfile::startup().for_threads(omp_get_max_threads());
+}
+
+namespace {
+
+const char *const FIELDS[] = {"parallel_min_bits", "split_min_bits",
+                              "fft_min_bits", "fft_max_bits",
+                              "ntt64_min_bits"};
+
+size_t *field(MulPolicy &p, int i) {
+  size_t *f[] = {&p.parallel_min_bits, &p.split_min_bits, &p.fft_min_bits,
+                 &p.fft_max_bits, &p.ntt64_min_bits};
+  return f[i];
+}
+
+std::string format_bits(size_t bits) {
+  return bits == MulPolicy::NEVER ? "never" : std::to_string(bits);
+}
+
+bool parse_bits(const std::string &s, size_t &bits) {
+  if (s == "never") {
+    bits = MulPolicy::NEVER;
+    return true;
+  }
+  if (s.empty() || s.find_first_not_of("0123456789") != std::string::npos)
+    return false;
+  // Out of range is malformed too, rather than an exception at startup
+  errno = 0;
+  const unsigned long long value = std::strtoull(s.c_str(), nullptr, 10);
+  if (errno == ERANGE || value > SIZE_MAX)
+    return false;
+  bits = (size_t)value;
+  return true;
+}
+
+} // namespace
+
+bool TuningProfile::load(const std::string &path) {
+  std::ifstream in(path);
+  if (!in.is_open())
+    return false;
+
+  std::vector<std::pair<int, MulPolicy>> parsed;
+  std::string line;
+  for (int line_no = 1; std::getline(in, line); ++line_no) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream tokens(line);
+    std::string token;
+    int threads = 0;
+    MulPolicy p;
+    bool ok = true, any = false;
+    while (ok && tokens >> token) {
+      any = true;
+      size_t eq = token.find('=');
+      std::string key = token.substr(0, eq);
+      std::string value = eq == std::string::npos ? "" : token.substr(eq + 1);
+      if (key == "threads") {
+        size_t t = 0;
+        ok = parse_bits(value, t) && t >= 1 && t <= 65536;
+        threads = (int)t;
+        continue;
+      }
+      int i = 0;
+      while (i < 5 && key != FIELDS[i])
+        ++i;
+      ok = i < 5 && parse_bits(value, *field(p, i));
+    }
+    if (!any)
+      continue;
+    if (!ok || threads == 0) {
+      std::cerr << path << ":" << line_no << ": malformed tuning entry, "
+                << "using built-in crossovers" << std::endl;
+      return false;
+    }
+    if (threads == 1)
+      p.parallel_min_bits = MulPolicy::NEVER;
+    parsed.push_back({threads, p});
+  }
+
+  entries.clear();
+  for (const auto &e : parsed)
+    set(e.first, e.second);
+  return true;
+}
+
+bool TuningProfile::save(const std::string &path) const {
+  std::ofstream out(path);
+  if (!out.is_open())
+    return false;
+  out << "# pi_calc multiplication crossovers, one line per team size.\n"
+      << "# Sizes are operand bits; regenerate with ./pi_calc --tune\n";
+  for (const auto &e : entries) {
+    MulPolicy p = e.second;
+    out << "threads=" << e.first;
+    for (int i = 0; i < 5; ++i)
+      out << " " << FIELDS[i] << "=" << format_bits(*field(p, i));
+    out << "\n";
+  }
+  return out.good();
+}
+
+void TuningProfile::set(int threads, const MulPolicy &policy) {
+  auto it = std::lower_bound(
+      entries.begin(), entries.end(), threads,
+      [](const std::pair<int, MulPolicy> &e, int t) { return e.first < t; });
+  if (it != entries.end() && it->first == threads)
+    it->second = policy;
+  else
+    entries.insert(it, {threads, policy});
+}
+
+MulPolicy TuningProfile::for_threads(int threads) const {
+  // A serial entry says nothing about parallel crossovers
+  MulPolicy p = MulPolicy::defaults(threads);
+  for (const auto &e : entries)
+    if (e.first <= threads && (e.first > 1 || threads == 1))
+      p = e.second;
+  return p;
+}
+
+const TuningProfile &TuningProfile::startup() {
+  static const TuningProfile profile = [] {
+    TuningProfile p;
+    p.load(DEFAULT_PATH);
+    return p;
+  }();
+  return profile;
+}
+
+namespace {
+
+// Times one product under the given policy, best of reps runs
+double time_product(mpz_t r, const mpz_t a, const mpz_t b,
+                    const MulPolicy &policy, int reps) {
+  double best = 1e300;
+  for (int i = 0; i < reps; ++i) {
+    Timer t;
+    NTTMultiplier::multiply(r, a, b, policy);
+    best = std::min(best, t.elapsed_seconds());
+  }
+  return best;
+}
+
+// Runs the products of a size sweep: for each size, times policy `base`
+// against `candidate(bits)` on random operands and returns the sizes at
+// which the candidate was faster.
+template <class Candidate>
+std::vector<size_t> sweep(const char *name, size_t from, size_t to,
+                          const MulPolicy &base, Candidate candidate,
+                          int reps) {
+  gmp_randstate_t rng;
+  gmp_randinit_default(rng);
+  mpz_t a, b, r;
+  mpz_inits(a, b, r, NULL);
+
+  std::vector<size_t> wins;
+  for (size_t bits = from; bits <= to; bits *= 2) {
+    mpz_urandomb(a, rng, bits);
+    mpz_urandomb(b, rng, bits);
+    double t_base = time_product(r, a, b, base, reps);
+    double t_cand = time_product(r, a, b, candidate(bits), reps);
+    printf("  %-10s %12zu bits  %9.4f s  %9.4f s%s\n", name, bits, t_base,
+           t_cand, t_cand < t_base ? "  *" : "");
+    fflush(stdout);
+    if (t_cand < t_base)
+      wins.push_back(bits);
+  }
+
+  mpz_clears(a, b, r, NULL);
+  gmp_randclear(rng);
+  return wins;
+}
+
+MulPolicy tune_team(int threads) {
+  MulPolicy p = MulPolicy::defaults(threads);
+  const MulPolicy never = [&] {
+    MulPolicy q = p;
+    q.parallel_min_bits = MulPolicy::NEVER;
+    return q;
+  }();
+
+  // mpz_mul against one NTT; the parallel path starts at the first size
+  // from which it keeps winning
+  std::vector<size_t> wins = sweep(
+      "parallel", 125000, 16000000, never,
+      [&](size_t) {
+        MulPolicy q = p.with_engine(MulEngine::NTT);
+        q.parallel_min_bits = 0;
+        return q;
+      },
+      3);
+  p.parallel_min_bits = MulPolicy::NEVER;
+  for (size_t bits = 16000000; !wins.empty() && wins.back() == bits;
+       bits /= 2, wins.pop_back())
+    p.parallel_min_bits = bits;
+  if (p.parallel_min_bits == MulPolicy::NEVER)
+    return p; // this team never beats GMP; nothing else is reachable
+
+  // FP FFT against the NTT at the leaves; a win at size b claims [b, 2b)
+  wins = sweep("fft", 1000000, 16000000, p.with_engine(MulEngine::NTT),
+               [&](size_t) { return p.with_engine(MulEngine::FFT); }, 3);
+  if (!wins.empty()) {
+    p.fft_min_bits = wins.front();
+    p.fft_max_bits = 2 * wins.back() - 1;
+  }
+
+  // One Toom-Cook level against a single transform
+  wins = sweep("split", 4000000, 16000000, p,
+               [&](size_t bits) {
+                 MulPolicy q = p;
+                 q.split_min_bits = bits;
+                 return q;
+               },
+               3);
+  if (!wins.empty())
+    p.split_min_bits = wins.front();
+
+  // 64-bit NTT against Toom-Cook over 32-bit leaves. Seconds per product
+  // at these sizes, so a single run each.
+  MulPolicy karatsuba = p;
+  karatsuba.ntt64_min_bits = MulPolicy::NEVER;
+  wins = sweep("ntt64", 64000000, 256000000, karatsuba,
+               [&](size_t) { return p.with_engine(MulEngine::NTT64); }, 1);
+  if (!wins.empty())
+    p.ntt64_min_bits = wins.front();
+  return p;
+}
+
+} // namespace
+
+TuningProfile TuningProfile::tune() {
+  const int max_threads = omp_get_max_threads();
+  std::vector<int> teams;
+  for (int t = 2; t < max_threads; t *= 2)
+    teams.push_back(t);
+  teams.push_back(max_threads);
+
+  TuningProfile profile;
+  profile.set(1, MulPolicy::defaults(1));
+  for (int threads : teams) {
+    if (threads == 1)
+      continue;
+    omp_set_num_threads(threads);
+    printf("Threads: %d  (baseline vs candidate, * = candidate faster)\n",
+           threads);
+    profile.set(threads, tune_team(threads));
+  }
+  omp_set_num_threads(max_threads);
+  return profile;
+}
+
+} // namespace pi
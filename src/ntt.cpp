@@ -1,13 +1,17 @@
 #include "ntt.hpp"
+#include "fft.hpp"
+#include "limb_arena.hpp"
+#include "ntt_kernel.hpp"
 #include <algorithm>
 #include <cmath>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <gmp.h>
+#include <memory>
 #include <vector>
 
 namespace pi {
-bool NTTMultiplier::use_hybrid = false;
 
 uint64_t NTTMultiplier::power(uint64_t base, uint64_t exp, uint64_t mod) {
   uint64_t res = 1;
@@ -25,122 +29,1216 @@ uint64_t NTTMultiplier::modInverse(uint64_t n, uint64_t mod) {
   return power(n, mod - 2, mod);
 }
 
+namespace {
+
+// Runs the vector and scalar kernels on the same pseudo-random input and
+// checks that forward and inverse transforms agree word for word, at one
+// radix-2 length and one four-step length.
+template <uint32_t Mod> bool simd_matches_scalar() {
+  using K = NTTKernel<Mod, NTTMultiplier::G>;
+  for (size_t n : {(size_t)1 << 12, (size_t)1 << 16}) {
+    std::vector<uint32_t> scalar(n), vector(n);
+    uint64_t seed = 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i < n; ++i) {
+      seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+      scalar[i] = vector[i] = (uint32_t)(seed >> 33) % Mod;
+    }
+    K::forward(scalar.data(), n, NTTPath::Scalar);
+    K::forward(vector.data(), n, NTTPath::AVX2);
+    if (scalar != vector)
+      return false;
+    K::inverse(scalar.data(), n, NTTPath::Scalar);
+    K::inverse(vector.data(), n, NTTPath::AVX2);
+    if (scalar != vector)
+      return false;
+  }
+  return true;
+}
+
+NTTPath select_ntt_path() {
+  if (!simd::cpu_has_avx2())
+    return NTTPath::Scalar;
+  if (simd_matches_scalar<NTTMultiplier::MODS[0]>() &&
+      simd_matches_scalar<NTTMultiplier::MODS[1]>() &&
+      simd_matches_scalar<NTTMultiplier::MODS[2]>())
+    return NTTPath::AVX2;
+  fprintf(stderr, "Warning: AVX2 NTT self-test failed, using scalar path\n");
+  return NTTPath::Scalar;
+}
+
+// Forward transform of 32-bit coefficients modulo one prime, zero-padded
+// to length n and left in Montgomery form.
+template <uint32_t Mod>
+std::vector<uint32_t> forward_prime(const std::vector<uint32_t> &coeffs,
+                                    size_t n) {
+  using K = NTTKernel<Mod, NTTMultiplier::G>;
+  using F = typename K::F;
+  std::vector<uint32_t> fa(n, 0);
+  for (size_t i = 0; i < coeffs.size(); ++i)
+    fa[i] = F::to_mont(coeffs[i]);
+  K::forward(fa.data(), n);
+  return fa;
+}
+
+// Pointwise product of two spectra and inverse transform; the result is
+// the plain (non-Montgomery) cyclic convolution in natural order.
+template <uint32_t Mod>
+std::vector<uint32_t> inverse_product(const std::vector<uint32_t> &fa,
+                                      const std::vector<uint32_t> &fb) {
+  using K = NTTKernel<Mod, NTTMultiplier::G>;
+  using F = typename K::F;
+  const size_t n = fa.size();
+  std::vector<uint32_t> res(n);
+  for (size_t i = 0; i < n; ++i)
+    res[i] = F::mul(fa[i], fb[i]);
+
+  K::inverse(res.data(), n);
+
+  // 1/n and the exit from Montgomery form in a single multiply
+  const uint32_t scale = K::scale_factor(n);
+  for (size_t i = 0; i < n; ++i)
+    res[i] = F::mul(res[i], scale);
+  return res;
+}
+
+// Forward transform of the 64-bit limbs of |op| modulo one 62-bit prime,
+// zero-padded to length n. The buffer is filled by a taskloop rather than
+// value-initialized, so its pages are first touched in parallel.
+template <uint64_t Mod>
+std::unique_ptr<uint64_t[]> forward_limbs(const mpz_t op, size_t n) {
+  using K = NTTKernel<Mod, NTTMultiplier::G>;
+  using F = typename K::F;
+  std::unique_ptr<uint64_t[]> fa(new uint64_t[n]);
+  uint64_t *f = fa.get();
+  const mp_limb_t *d = mpz_limbs_read(op);
+  const size_t size = mpz_size(op);
+#pragma omp taskloop firstprivate(f, d, size) grainsize(65536)
+  for (size_t i = 0; i < n; ++i)
+    f[i] = i < size ? F::to_mont(d[i]) : 0;
+  K::forward(f, n);
+  return fa;
+}
+
+// In-place counterpart of inverse_product: fa becomes the plain cyclic
+// convolution of the two spectra.
+template <uint64_t Mod>
+void inverse_product64(uint64_t *fa, const uint64_t *fb, size_t n) {
+  using K = NTTKernel<Mod, NTTMultiplier::G>;
+  using F = typename K::F;
+#pragma omp taskloop firstprivate(fa, fb) grainsize(65536)
+  for (size_t i = 0; i < n; ++i)
+    fa[i] = F::mul(fa[i], fb[i]);
+
+  K::inverse(fa, n);
+
+  const uint64_t scale = K::scale_factor(n);
+#pragma omp taskloop firstprivate(fa, scale) grainsize(65536)
+  for (size_t i = 0; i < n; ++i)
+    fa[i] = F::mul(fa[i], scale);
+}
+
+// Cyclic convolution of the limbs of |op1| and |op2| modulo one 62-bit
+// prime: both forward transforms in flight at once (one when squaring),
+// then the pointwise product and the inverse.
+template <uint64_t Mod>
+std::unique_ptr<uint64_t[]> convolve_limbs(const mpz_t op1, const mpz_t op2,
+                                           size_t n) {
+  std::unique_ptr<uint64_t[]> fa, fb;
+  if (op1 == op2) {
+    fa = forward_limbs<Mod>(op1, n);
+    inverse_product64<Mod>(fa.get(), fa.get(), n);
+    return fa;
+  }
+#pragma omp task shared(fa)
+  fa = forward_limbs<Mod>(op1, n);
+#pragma omp task shared(fb)
+  fb = forward_limbs<Mod>(op2, n);
+#pragma omp taskwait
+  inverse_product64<Mod>(fa.get(), fb.get(), n);
+  return fa;
+}
+
+// Runs fn on the current team, opening one when called from serial code
+// (Step 2 and base conversion) rather than from Step 1 tasks.
+template <class Fn> void in_team(Fn &&fn) {
+  if (omp_in_parallel()) {
+    fn();
+  } else {
+#pragma omp parallel
+    {
+#pragma omp single
+      fn();
+    }
+  }
+}
+
+} // namespace
+
+NTTPath ntt_path() {
+  static const NTTPath path = select_ntt_path();
+  return path;
+}
+
+void NTTMultiplier::ntt(std::vector<uint32_t> &a, bool invert, uint32_t mod) {
+  uint32_t *d = a.data();
+  size_t n = a.size();
+  switch (mod) {
+  case MODS[0]:
+    invert ? NTTKernel<MODS[0], G>::inverse(d, n)
+           : NTTKernel<MODS[0], G>::forward(d, n);
+    break;
+  case MODS[1]:
+    invert ? NTTKernel<MODS[1], G>::inverse(d, n)
+           : NTTKernel<MODS[1], G>::forward(d, n);
+    break;
+  case MODS[2]:
+    invert ? NTTKernel<MODS[2], G>::inverse(d, n)
+           : NTTKernel<MODS[2], G>::forward(d, n);
+    break;
+  default:
+    std::abort();
+  }
+}
+
 void NTTMultiplier::ntt(std::vector<uint64_t> &a, bool invert, uint64_t mod) {
-  int n = a.size();
-  for (int i = 1, j = 0; i < n; i++) {
-    int bit = n >> 1;
-    for (; j & bit; bit >>= 1)
-      j ^= bit;
-    j ^= bit;
-    if (i < j)
-      std::swap(a[i], a[j]);
-  }
-
-  for (int len = 2; len <= n; len <<= 1) {
-    uint64_t wlen = power(G, (mod - 1) / len, mod);
-    if (invert)
-      wlen = modInverse(wlen, mod);
-
-#pragma omp parallel for if (n > 65536) schedule(static)
-    for (int i = 0; i < n; i += len) {
-      uint64_t w = 1;
-      for (int j = 0; j < len / 2; j++) {
-        uint64_t u = a[i + j];
-        uint64_t v = (__uint128_t)a[i + j + len / 2] * w % mod;
-        a[i + j] = (u + v) % mod;
-        if (a[i + j] >= mod)
-          a[i + j] -= mod;
-        a[i + j + len / 2] = (u - v + mod) % mod;
-        w = (__uint128_t)w * wlen % mod;
-      }
+  uint64_t *d = a.data();
+  size_t n = a.size();
+  switch (mod) {
+  case MODS64[0]:
+    invert ? NTTKernel<MODS64[0], G>::inverse(d, n)
+           : NTTKernel<MODS64[0], G>::forward(d, n);
+    break;
+  case MODS64[1]:
+    invert ? NTTKernel<MODS64[1], G>::inverse(d, n)
+           : NTTKernel<MODS64[1], G>::forward(d, n);
+    break;
+  case MODS64[2]:
+    invert ? NTTKernel<MODS64[2], G>::inverse(d, n)
+           : NTTKernel<MODS64[2], G>::forward(d, n);
+    break;
+  default:
+    std::abort();
+  }
+}
+
+std::vector<uint32_t> NTTMultiplier::mpz_to_vec(const mpz_t n,
+                                                size_t &limbs) {
+  constexpr int per_limb = GMP_NUMB_BITS / COEFF_BITS;
+  size_t size = mpz_size(n);
+  const mp_limb_t *d = mpz_limbs_read(n);
+
+  std::vector<uint32_t> vec(size * per_limb);
+  for (size_t i = 0; i < size; ++i) {
+    mp_limb_t limb = d[i];
+    for (int k = 0; k < per_limb; ++k) {
+      vec[i * per_limb + k] = (uint32_t)limb;
+      limb = (per_limb > 1) ? (limb >> (COEFF_BITS % GMP_NUMB_BITS)) : 0;
     }
   }
+  while (!vec.empty() && vec.back() == 0)
+    vec.pop_back();
+  limbs = vec.size();
+  return vec;
+}
 
-  if (invert) {
-    uint64_t n_inv = modInverse(n, mod);
-    for (uint64_t &x : a)
-      x = (__uint128_t)x * n_inv % mod;
+void NTTMultiplier::vec_to_mpz(mpz_t rop, const std::vector<uint32_t> &vec) {
+  constexpr int per_limb = GMP_NUMB_BITS / COEFF_BITS;
+  size_t size = (vec.size() + per_limb - 1) / per_limb;
+  if (size == 0) {
+    mpz_set_ui(rop, 0);
+    return;
+  }
+
+  mp_limb_t *d = mpz_limbs_write(rop, size);
+  for (size_t i = 0; i < size; ++i) {
+    mp_limb_t limb = 0;
+    for (int k = per_limb - 1; k >= 0; --k) {
+      size_t idx = i * per_limb + k;
+      uint32_t word = idx < vec.size() ? vec[idx] : 0;
+      limb = (per_limb > 1) ? (limb << (COEFF_BITS % GMP_NUMB_BITS)) : 0;
+      limb |= (mp_limb_t)word;
+    }
+    d[i] = limb;
   }
+  mpz_limbs_finish(rop, size);
 }
 
-void parallel_mul_karatsuba(mpz_t rop, const mpz_t op1, const mpz_t op2,
-                            int depth) {
+size_t NTTMultiplier::transform_length(size_t bits1, size_t bits2) {
+  size_t coeffs = (bits1 + COEFF_BITS - 1) / COEFF_BITS +
+                  (bits2 + COEFF_BITS - 1) / COEFF_BITS;
+  size_t n = 1;
+  while (n < coeffs)
+    n <<= 1;
+  return n;
+}
+
+bool NTTMultiplier::fits_ntt(size_t bits1, size_t bits2) {
+  return transform_length(bits1, bits2) <= ((size_t)1 << MAX_LOG_LEN);
+}
+
+size_t NTTMultiplier::transform_length64(size_t bits1, size_t bits2) {
+  size_t coeffs = (bits1 + 63) / 64 + (bits2 + 63) / 64;
+  size_t n = 1;
+  while (n < coeffs)
+    n <<= 1;
+  return n;
+}
+
+bool NTTMultiplier::fits_ntt64(size_t bits1, size_t bits2) {
+  return transform_length64(bits1, bits2) <= ((size_t)1 << MAX_LOG_LEN64);
+}
+
+bool NTTMultiplier::use_ntt(size_t bits1, size_t bits2,
+                            const MulPolicy &policy) {
+  return std::min(bits1, bits2) >= policy.parallel_min_bits &&
+         fits_ntt(bits1, bits2);
+}
+
+void NTTMultiplier::forward_all(TransformedOperand &t, const mpz_t op,
+                                size_t n) {
+  t.source = op;
+  t.bits = mpz_sizeinbase(op, 2);
+  t.sign = mpz_sgn(op);
+  t.n = n;
+  std::vector<uint32_t> coeffs = mpz_to_vec(op, t.coeffs);
+
+  // One transform per prime, all three in flight at once
+  std::vector<uint32_t> *spec = t.spectrum;
+#pragma omp task shared(coeffs) firstprivate(spec, n)
+  spec[0] = forward_prime<MODS[0]>(coeffs, n);
+#pragma omp task shared(coeffs) firstprivate(spec, n)
+  spec[1] = forward_prime<MODS[1]>(coeffs, n);
+#pragma omp task shared(coeffs) firstprivate(spec, n)
+  spec[2] = forward_prime<MODS[2]>(coeffs, n);
+#pragma omp taskwait
+}
+
+void NTTMultiplier::ntt_multiply(mpz_t rop, const mpz_t op1,
+                                 const mpz_t op2) {
+  if (mpz_sgn(op1) == 0 || mpz_sgn(op2) == 0) {
+    mpz_set_ui(rop, 0);
+    return;
+  }
+
+  size_t n = transform_length(mpz_sizeinbase(op1, 2), mpz_sizeinbase(op2, 2));
+
+  TransformedOperand a, b;
+#pragma omp task shared(a)
+  forward_all(a, op1, n);
+#pragma omp task shared(b)
+  forward_all(b, op2, n);
+#pragma omp taskwait
+  pointwise_multiply(rop, a, b);
+}
+
+void NTTMultiplier::ntt_square(mpz_t rop, const mpz_t op) {
+  if (mpz_sgn(op) == 0) {
+    mpz_set_ui(rop, 0);
+    return;
+  }
+  size_t bits = mpz_sizeinbase(op, 2);
+  TransformedOperand a;
+  forward_all(a, op, transform_length(bits, bits));
+  pointwise_multiply(rop, a, a);
+}
+
+std::vector<__uint128_t>
+NTTMultiplier::crt_coeffs(const std::vector<uint32_t> &r0,
+                          const std::vector<uint32_t> &r1,
+                          const std::vector<uint32_t> &r2, size_t from,
+                          size_t to) {
+  // Garner CRT: x = r0 + p0 * t1 + p0 * p1 * t2 < p0 * p1 * p2 < 2^89.
+  // x01 = r0 + p0 * t1 < 2^60, so only the last step needs 128 bits.
+  static const uint64_t p0 = MODS[0], p1 = MODS[1], p2 = MODS[2];
+  static const uint64_t inv_p0_p1 = modInverse(p0 % p1, p1);
+  static const uint64_t p0p1_p2 = (__uint128_t)p0 * p1 % p2;
+  static const uint64_t inv_p0p1_p2 = modInverse(p0p1_p2, p2);
+  const __uint128_t p0p1 = (__uint128_t)p0 * p1;
+
+  const size_t len = to - from;
+  std::vector<__uint128_t> coeffs(len);
+#pragma omp taskloop shared(r0, r1, r2, coeffs) if (len > 65536) grainsize(16384)
+  for (size_t k = 0; k < len; ++k) {
+    const size_t i = from + k;
+    uint64_t t1 = (r1[i] + p1 - r0[i] % p1) % p1 * inv_p0_p1 % p1;
+    uint64_t x01 = p0 * t1 + r0[i];
+    uint64_t t2 = (r2[i] + p2 - x01 % p2) % p2 * inv_p0p1_p2 % p2;
+    coeffs[k] = x01 + p0p1 * t2;
+  }
+  return coeffs;
+}
+
+void NTTMultiplier::pointwise_multiply(mpz_t rop, const TransformedOperand &a,
+                                       const TransformedOperand &b) {
+  std::vector<uint32_t> r0, r1, r2;
+#pragma omp task shared(a, b, r0)
+  r0 = inverse_product<MODS[0]>(a.spectrum[0], b.spectrum[0]);
+#pragma omp task shared(a, b, r1)
+  r1 = inverse_product<MODS[1]>(a.spectrum[1], b.spectrum[1]);
+#pragma omp task shared(a, b, r2)
+  r2 = inverse_product<MODS[2]>(a.spectrum[2], b.spectrum[2]);
+#pragma omp taskwait
+
+  size_t out_len = a.coeffs + b.coeffs - 1;
+  std::vector<__uint128_t> coeffs = crt_coeffs(r0, r1, r2, 0, out_len);
+  std::vector<uint32_t>().swap(r0);
+  std::vector<uint32_t>().swap(r1);
+  std::vector<uint32_t>().swap(r2);
+
+  // Carry propagation back into 32-bit words
+  std::vector<uint32_t> out(out_len + 4, 0);
+  __uint128_t carry = 0;
+  for (size_t i = 0; i < out_len; ++i) {
+    carry += coeffs[i];
+    out[i] = (uint32_t)carry;
+    carry >>= COEFF_BITS;
+  }
+  for (size_t i = out_len; carry != 0; ++i) {
+    out[i] = (uint32_t)carry;
+    carry >>= COEFF_BITS;
+  }
+  std::vector<__uint128_t>().swap(coeffs);
+
+  vec_to_mpz(rop, out);
+  if (a.sign * b.sign < 0)
+    mpz_neg(rop, rop);
+}
+
+void NTTMultiplier::crt_carry64(const uint64_t *r0, const uint64_t *r1,
+                                const uint64_t *r2, size_t from, size_t to,
+                                mp_limb_t *out, size_t limbs) {
+  // Garner CRT: x = r0 + p0 * t1 + p0 * p1 * t2 < p0 * p1 * p2 < 2^186.
+  // Residues are combined with Montgomery multiplies against constants
+  // kept in Montgomery form, which yields plain products.
+  using F1 = MontgomeryField64<MODS64[1]>;
+  using F2 = MontgomeryField64<MODS64[2]>;
+  constexpr uint64_t p0 = MODS64[0], p1 = MODS64[1], p2 = MODS64[2];
+  static const uint64_t inv_p0 = F1::pow(F1::to_mont(p0 % p1), p1 - 2);
+  static const uint64_t p0_mod_p2 = F2::to_mont(p0 % p2);
+  static const uint64_t inv_p0p1 =
+      F2::pow(F2::mul(F2::to_mont(p0 % p2), F2::to_mont(p1 % p2)), p2 - 2);
+  const __uint128_t p0p1 = (__uint128_t)p0 * p1;
+  const uint64_t p0p1_lo = (uint64_t)p0p1, p0p1_hi = (uint64_t)(p0p1 >> 64);
+
+  // Every chunk of coefficients is combined and carried independently into
+  // the output limbs; the carry out of each chunk is added afterwards.
+  const size_t len = to - from;
+  constexpr size_t CHUNK = 65536;
+  const size_t chunks = (len + CHUNK - 1) / CHUNK;
+  std::vector<__uint128_t> chunk_carry(chunks);
+  std::fill(out + len, out + limbs, 0);
+#pragma omp taskloop shared(chunk_carry) firstprivate(out, r0, r1, r2)
+  for (size_t k = 0; k < chunks; ++k) {
+    const size_t i1 = std::min(len, (k + 1) * CHUNK);
+    __uint128_t carry = 0;
+    for (size_t i = k * CHUNK; i < i1; ++i) {
+      uint64_t a = r0[from + i];
+      uint64_t t1 =
+          F1::mul(F1::sub(r1[from + i], a >= p1 ? a - p1 : a), inv_p0);
+      uint64_t x01_p2 = F2::add(a >= p2 ? a - p2 : a, F2::mul(t1, p0_mod_p2));
+      uint64_t t2 = F2::mul(F2::sub(r2[from + i], x01_p2), inv_p0p1);
+
+      // x = x01 + p0p1 * t2 as three limbs, then add the running carry
+      __uint128_t x01 = (__uint128_t)p0 * t1 + a;
+      __uint128_t lo = (__uint128_t)p0p1_lo * t2 + (uint64_t)x01;
+      __uint128_t hi = (__uint128_t)p0p1_hi * t2 + (uint64_t)(x01 >> 64) +
+                       (uint64_t)(lo >> 64);
+      uint64_t x0 = (uint64_t)lo + (uint64_t)carry;
+      hi += (x0 < (uint64_t)lo) + (carry >> 64);
+      out[i] = x0;
+      carry = hi;
+    }
+    chunk_carry[k] = carry;
+  }
+  for (size_t k = 0; k < chunks; ++k) {
+    __uint128_t v = chunk_carry[k];
+    for (size_t j = std::min(len, (k + 1) * CHUNK); v != 0 && j < limbs;
+         ++j) {
+      uint64_t sum = out[j] + (uint64_t)v;
+      v = (v >> 64) + (sum < out[j]);
+      out[j] = sum;
+    }
+  }
+}
+
+void NTTMultiplier::ntt64_multiply(mpz_t rop, const mpz_t op1,
+                                   const mpz_t op2) {
+  if (mpz_sgn(op1) == 0 || mpz_sgn(op2) == 0) {
+    mpz_set_ui(rop, 0);
+    return;
+  }
+  const int sign = mpz_sgn(op1) * mpz_sgn(op2);
+  const size_t s1 = mpz_size(op1), s2 = mpz_size(op2);
+  const size_t n = transform_length64(s1 * 64, s2 * 64);
+
+  std::unique_ptr<uint64_t[]> r[3];
+#pragma omp task shared(r)
+  r[0] = convolve_limbs<MODS64[0]>(op1, op2, n);
+#pragma omp task shared(r)
+  r[1] = convolve_limbs<MODS64[1]>(op1, op2, n);
+#pragma omp task shared(r)
+  r[2] = convolve_limbs<MODS64[2]>(op1, op2, n);
+#pragma omp taskwait
+
+  const size_t len = s1 + s2 - 1, limbs = s1 + s2;
+  mp_limb_t *out = mpz_limbs_write(rop, limbs);
+  crt_carry64(r[0].get(), r[1].get(), r[2].get(), 0, len, out, limbs);
+  mpz_limbs_finish(rop, limbs);
+  if (sign < 0)
+    mpz_neg(rop, rop);
+}
+
+NTTMultiplier::TransformedOperand
+NTTMultiplier::transform(const mpz_t op, size_t partner_bits,
+                         const MulPolicy &policy) {
+  TransformedOperand t;
+  t.source = op;
+  t.bits = mpz_sizeinbase(op, 2);
+  t.partner_bits = partner_bits;
+  if (mpz_sgn(op) == 0 || !use_ntt(t.bits, partner_bits, policy))
+    return t; // not transformed: multiply() falls back to the mpz
+
+  size_t n = transform_length(t.bits, partner_bits);
+  in_team([&] { forward_all(t, op, n); });
+  return t;
+}
+
+void NTTMultiplier::multiply(mpz_t rop, const mpz_t op1,
+                             const TransformedOperand &op2,
+                             const MulPolicy &policy) {
   size_t bits1 = mpz_sizeinbase(op1, 2);
-  size_t bits2 = mpz_sizeinbase(op2, 2);
+  if (!op2.is_transformed() || bits1 > op2.partner_bits ||
+      !use_ntt(bits1, op2.bits, policy) || mpz_sgn(op1) == 0) {
+    multiply(rop, op1, op2.source, policy);
+    return;
+  }
+  in_team([&] {
+    TransformedOperand a;
+    forward_all(a, op1, op2.n);
+    pointwise_multiply(rop, a, op2);
+  });
+}
+
+void NTTMultiplier::multiply(mpz_t rop, const TransformedOperand &op1,
+                             const TransformedOperand &op2,
+                             const MulPolicy &policy) {
+  if (!op1.is_transformed() || !op2.is_transformed() || op1.n != op2.n) {
+    multiply(rop, op1.source, op2.source, policy);
+    return;
+  }
+  in_team([&] { pointwise_multiply(rop, op1, op2); });
+}
+
+void NTTMultiplier::convolve_window(mpz_t rop, const mpz_t op1,
+                                    const mpz_t op2, bool wide, size_t n,
+                                    size_t from, size_t to) {
+  if (mpz_sgn(op1) == 0 || mpz_sgn(op2) == 0 || to <= from) {
+    mpz_set_ui(rop, 0);
+    return;
+  }
+
+  if (wide) {
+    std::unique_ptr<uint64_t[]> r[3];
+#pragma omp task shared(r)
+    r[0] = convolve_limbs<MODS64[0]>(op1, op2, n);
+#pragma omp task shared(r)
+    r[1] = convolve_limbs<MODS64[1]>(op1, op2, n);
+#pragma omp task shared(r)
+    r[2] = convolve_limbs<MODS64[2]>(op1, op2, n);
+#pragma omp taskwait
+    const size_t limbs = to - from + 3;
+    mp_limb_t *out = mpz_limbs_write(rop, limbs);
+    crt_carry64(r[0].get(), r[1].get(), r[2].get(), from, to, out, limbs);
+    mpz_limbs_finish(rop, limbs);
+    return;
+  }
+
+  TransformedOperand a, b;
+  if (op1 == op2) {
+    forward_all(a, op1, n);
+  } else {
+#pragma omp task shared(a)
+    forward_all(a, op1, n);
+#pragma omp task shared(b)
+    forward_all(b, op2, n);
+#pragma omp taskwait
+  }
+  const TransformedOperand &bb = op1 == op2 ? a : b;
+  std::vector<uint32_t> r0, r1, r2;
+#pragma omp task shared(a, bb, r0)
+  r0 = inverse_product<MODS[0]>(a.spectrum[0], bb.spectrum[0]);
+#pragma omp task shared(a, bb, r1)
+  r1 = inverse_product<MODS[1]>(a.spectrum[1], bb.spectrum[1]);
+#pragma omp task shared(a, bb, r2)
+  r2 = inverse_product<MODS[2]>(a.spectrum[2], bb.spectrum[2]);
+#pragma omp taskwait
+  for (std::vector<uint32_t> &spec : a.spectrum)
+    std::vector<uint32_t>().swap(spec);
+  for (std::vector<uint32_t> &spec : b.spectrum)
+    std::vector<uint32_t>().swap(spec);
+
+  std::vector<__uint128_t> coeffs = crt_coeffs(r0, r1, r2, from, to);
+  std::vector<uint32_t>().swap(r0);
+  std::vector<uint32_t>().swap(r1);
+  std::vector<uint32_t>().swap(r2);
+
+  const size_t len = to - from;
+  std::vector<uint32_t> out(len + 4, 0);
+  __uint128_t carry = 0;
+  for (size_t i = 0; i < len; ++i) {
+    carry += coeffs[i];
+    out[i] = (uint32_t)carry;
+    carry >>= COEFF_BITS;
+  }
+  for (size_t i = len; carry != 0; ++i) {
+    out[i] = (uint32_t)carry;
+    carry >>= COEFF_BITS;
+  }
+  std::vector<__uint128_t>().swap(coeffs);
+  vec_to_mpz(rop, out);
+}
+
+int NTTMultiplier::window_word(const MulPolicy &policy, size_t bits) {
+  const size_t words = (bits + COEFF_BITS - 1) / COEFF_BITS;
+  if (leaf_engine(policy, bits, bits) != Engine::NTT64 &&
+      words <= ((size_t)1 << MAX_LOG_LEN))
+    return COEFF_BITS;
+  return 64;
+}
+
+namespace {
+
+size_t next_pow2(size_t n) {
+  size_t p = 1;
+  while (p < n)
+    p <<= 1;
+  return p;
+}
+
+// x mod (2^K - 1) for x >= 0, in [0, 2^K - 1)
+void fold_mod(mpz_t x, size_t K) {
+  if (mpz_sizeinbase(x, 2) > K) {
+    mpz_t high;
+    mpz_init(high);
+    while (mpz_sizeinbase(x, 2) > K) {
+      mpz_tdiv_q_2exp(high, x, K);
+      mpz_tdiv_r_2exp(x, x, K);
+      mpz_add(x, x, high);
+    }
+    mpz_clear(high);
+  }
+  if (mpz_sizeinbase(x, 2) == K && mpz_scan0(x, 0) >= K)
+    mpz_set_ui(x, 0);
+}
+
+// Words below `from` that a window starts early so the carry it never
+// sees stays under a unit of the lowest wanted bit: coefficients are below
+// 2^89 for 32-bit words and 2^171 for limbs
+constexpr size_t WINDOW_GUARD_WORDS = 2;
+
+size_t window_from(size_t lo, int w) {
+  const size_t word = lo / w;
+  return word > WINDOW_GUARD_WORDS ? word - WINDOW_GUARD_WORDS : 0;
+}
+
+} // namespace
+
+void NTTMultiplier::multiply_high(mpz_t rop, const mpz_t op1, const mpz_t op2,
+                                  size_t shift, const MulPolicy &policy) {
+  const size_t bits1 = mpz_sizeinbase(op1, 2);
+  const size_t bits2 = mpz_sizeinbase(op2, 2);
+  const Engine engine = leaf_engine(policy, bits1, bits2);
+  if (std::min(bits1, bits2) < policy.parallel_min_bits ||
+      engine == Engine::FFT || split_product(policy, bits1, bits2) ||
+      bits1 + bits2 <= shift) {
+    multiply(rop, op1, op2, policy);
+    mpz_tdiv_q_2exp(rop, rop, shift);
+    return;
+  }
+
+  const int sign = mpz_sgn(op1) * mpz_sgn(op2);
+  const int w = window_word(policy, bits1 + bits2);
+  const size_t len = (bits1 + w - 1) / w + (bits2 + w - 1) / w - 1;
+  const size_t from = window_from(shift, w);
+  in_team([&] {
+    convolve_window(rop, op1, op2, w == 64, next_pow2(len), from, len);
+  });
+  mpz_tdiv_q_2exp(rop, rop, shift - from * w);
+  if (sign < 0)
+    mpz_neg(rop, rop);
+}
+
+void NTTMultiplier::multiply_middle(mpz_t rop, const mpz_t op1,
+                                    const mpz_t op2, size_t lo, size_t hi,
+                                    const MulPolicy &policy) {
+  const size_t bits1 = mpz_sizeinbase(op1, 2);
+  const size_t bits2 = mpz_sizeinbase(op2, 2);
+  if (std::min(bits1, bits2) < policy.parallel_min_bits) {
+    mpz_mul(rop, op1, op2);
+  } else {
+    // The shortest length keeping [from, to) clear of the wrapped top,
+    // and long enough for each operand
+    size_t n = 0, from = 0;
+    int w = 0;
+    for (int word : {COEFF_BITS, 64}) {
+      const size_t words1 = (bits1 + word - 1) / word;
+      const size_t words2 = (bits2 + word - 1) / word;
+      const size_t len = words1 + words2 - 1;
+      from = window_from(lo, word);
+      const size_t to = (hi + word - 1) / word;
+      n = next_pow2(std::max({to, len > from ? len - from : 1, words1,
+                              words2}));
+      w = word;
+      if (word == COEFF_BITS &&
+          window_word(policy, n * COEFF_BITS) == COEFF_BITS)
+        break;
+    }
+    const size_t to = std::min(n, (hi + w - 1) / w);
+    in_team([&] { convolve_window(rop, op1, op2, w == 64, n, from, to); });
+    lo -= from * w;
+    hi -= from * w;
+  }
+  mpz_tdiv_q_2exp(rop, rop, lo);
+  mpz_tdiv_r_2exp(rop, rop, hi - lo);
+}
+
+size_t NTTMultiplier::wrap_bits(size_t bits, const MulPolicy &policy) {
+  if (bits < policy.parallel_min_bits)
+    return (bits + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS * GMP_NUMB_BITS;
+  const int w = window_word(policy, bits);
+  return next_pow2((bits + w - 1) / w) * w;
+}
+
+void NTTMultiplier::multiply_wrapped(mpz_t rop, const mpz_t op1,
+                                     const mpz_t op2, size_t K,
+                                     const MulPolicy &policy) {
+  // Operands wider than the modulus are folded first
+  mpz_t f1, f2;
+  mpz_inits(f1, f2, NULL);
+  mpz_srcptr a = op1, b = op2;
+  if (mpz_sizeinbase(op1, 2) > K) {
+    mpz_set(f1, op1);
+    fold_mod(f1, K);
+    a = f1;
+  }
+  if (op2 == op1) {
+    b = a;
+  } else if (mpz_sizeinbase(op2, 2) > K) {
+    mpz_set(f2, op2);
+    fold_mod(f2, K);
+    b = f2;
+  }
+
+  const size_t bits1 = mpz_sizeinbase(a, 2), bits2 = mpz_sizeinbase(b, 2);
+  const int w = window_word(policy, K);
+  const size_t n = K / w;
+  if (std::min(bits1, bits2) < policy.parallel_min_bits || K % w != 0 ||
+      n != next_pow2(n)) {
+    mpz_mul(rop, a, b);
+  } else {
+    in_team([&] { convolve_window(rop, a, b, w == 64, n, 0, n); });
+  }
+  fold_mod(rop, K);
+  mpz_clears(f1, f2, NULL);
+}
+
+NTTMultiplier::Engine NTTMultiplier::leaf_engine(const MulPolicy &policy,
+                                                size_t bits1, size_t bits2) {
+  if (policy.engine != Engine::Auto)
+    return policy.engine;
   size_t max_bits = std::max(bits1, bits2);
+  if (max_bits >= policy.ntt64_min_bits)
+    return Engine::NTT64;
+  if (max_bits >= policy.fft_min_bits && max_bits <= policy.fft_max_bits)
+    return Engine::FFT;
+  return Engine::NTT;
+}
+
+bool NTTMultiplier::split_product(const MulPolicy &policy, size_t bits1,
+                                  size_t bits2) {
+  if (std::max(bits1, bits2) >= policy.split_min_bits)
+    return true;
+  // The FFT hands products it cannot bound to the 32-bit NTT
+  if (leaf_engine(policy, bits1, bits2) == Engine::NTT64)
+    return !fits_ntt64(bits1, bits2);
+  return !fits_ntt(bits1, bits2);
+}
 
-  if (depth <= 0 || max_bits < 4000000) {
+void NTTMultiplier::leaf_multiply(mpz_t rop, const mpz_t op1, const mpz_t op2,
+                                  const MulPolicy &policy) {
+  size_t bits1 = mpz_sizeinbase(op1, 2);
+  size_t bits2 = mpz_sizeinbase(op2, 2);
+  if (std::min(bits1, bits2) < policy.parallel_min_bits) {
     mpz_mul(rop, op1, op2);
     return;
   }
 
-  size_t split = max_bits / 2;
+  Engine engine = leaf_engine(policy, bits1, bits2);
+  if (engine == Engine::FFT && FFTMultiplier::multiply(rop, op1, op2))
+    return;
+  if (fits_ntt(bits1, bits2) && engine != Engine::NTT64) {
+    if (op1 == op2)
+      ntt_square(rop, op1);
+    else
+      ntt_multiply(rop, op1, op2);
+  } else if (fits_ntt64(bits1, bits2)) {
+    ntt64_multiply(rop, op1, op2);
+  } else {
+    mpz_mul(rop, op1, op2);
+  }
+}
+
+namespace {
 
-  mpz_t a_h, a_l, b_h, b_l;
-  mpz_inits(a_h, a_l, b_h, b_l, NULL);
+// Signed value in a fixed-length limb buffer, for Toom interpolation. The
+// buffers are long enough that no intermediate overflows them.
+struct Coeff {
+  mp_limb_t *p;
+  bool neg;
+};
 
-  mpz_tdiv_q_2exp(a_h, op1, split);
-  mpz_tdiv_r_2exp(a_l, op1, split);
-  mpz_tdiv_q_2exp(b_h, op2, split);
-  mpz_tdiv_r_2exp(b_l, op2, split);
+// r = x + y; r may be x or y
+void coeff_add(Coeff &r, const Coeff &x, const Coeff &y, mp_size_t len) {
+  bool xn = x.neg, yn = y.neg;
+  if (xn == yn) {
+    mpn_add_n(r.p, x.p, y.p, len);
+    r.neg = xn;
+  } else if (mpn_cmp(x.p, y.p, len) >= 0) {
+    mpn_sub_n(r.p, x.p, y.p, len);
+    r.neg = xn;
+  } else {
+    mpn_sub_n(r.p, y.p, x.p, len);
+    r.neg = yn;
+  }
+}
 
-  mpz_t z2, z0, z1, sum_a, sum_b;
-  mpz_inits(z2, z0, z1, sum_a, sum_b, NULL);
+// r = x - y; r may be x or y
+void coeff_sub(Coeff &r, const Coeff &x, const Coeff &y, mp_size_t len) {
+  Coeff minus_y = {y.p, !y.neg};
+  coeff_add(r, x, minus_y, len);
+}
 
-  mpz_add(sum_a, a_h, a_l);
-  mpz_add(sum_b, b_h, b_l);
+// r = x * c for a small constant c
+void coeff_mul(Coeff &r, const Coeff &x, mp_limb_t c, mp_size_t len) {
+  mpn_mul_1(r.p, x.p, len, c);
+  r.neg = x.neg;
+}
 
-#pragma omp task shared(z2)
-  parallel_mul_karatsuba(z2, a_h, b_h, depth - 1);
+// r /= d for d = 2^s (given as s) or an odd d, with the division exact
+void coeff_shr(Coeff &r, unsigned s, mp_size_t len) {
+  mpn_rshift(r.p, r.p, len, s);
+}
+void coeff_div(Coeff &r, mp_limb_t d, mp_size_t len) {
+  if (d == 3)
+    mpn_divexact_by3(r.p, r.p, len);
+  else
+    mpn_divrem_1(r.p, 0, r.p, len, d);
+}
 
-#pragma omp task shared(z0)
-  parallel_mul_karatsuba(z0, a_l, b_l, depth - 1);
+// acc[0 .. m] += {piece, len} * mult, len <= m
+void accumulate(mp_limb_t *acc, mp_size_t m, const mp_limb_t *piece,
+                mp_size_t len, mp_limb_t mult) {
+  if (len == 0)
+    return;
+  mp_limb_t carry = mpn_addmul_1(acc, piece, len, mult);
+  mpn_add_1(acc + len, acc + len, m + 1 - len, carry);
+}
 
-#pragma omp task shared(z1)
-  parallel_mul_karatsuba(z1, sum_a, sum_b, depth - 1);
+// Limbs of piece i when {xp, xn} is cut into pieces of m limbs
+mp_size_t piece_len(mp_size_t xn, int i, mp_size_t m) {
+  return std::max<mp_size_t>(0, std::min<mp_size_t>(m, xn - i * m));
+}
+
+// Values of x(t) = sum x_i t^i, x_i the k pieces of {xp, xn}, at the
+// points 1, -1, 2, -2 and, as 8 x(1/2), 1/2 (the first 2k - 3 of them),
+// each in m + 1 limbs of out with its sign in neg. tmp holds 2 (m + 1).
+void toom_evaluate(const mp_limb_t *xp, mp_size_t xn, int k, mp_size_t m,
+                   mp_limb_t *out, bool *neg, mp_limb_t *tmp) {
+  const mp_size_t w = m + 1;
+  mp_limb_t *even = tmp, *odd = tmp + w;
 
+  // x(t) = even + odd and x(-t) = even - odd for t = 1, 2
+  for (int t = 1, j = 0; t <= 2 && j < 2 * k - 3; t *= 2) {
+    mpn_zero(even, w);
+    mpn_zero(odd, w);
+    for (int i = 0; i < k; ++i)
+      accumulate(i % 2 ? odd : even, m, xp + i * m, piece_len(xn, i, m),
+                 (mp_limb_t)1 << (i * (t - 1)));
+    mpn_add_n(out + j * w, even, odd, w);
+    neg[j++] = false;
+    if (j == 2 * k - 3)
+      continue;
+    neg[j] = mpn_cmp(even, odd, w) < 0;
+    if (neg[j])
+      mpn_sub_n(out + j * w, odd, even, w);
+    else
+      mpn_sub_n(out + j * w, even, odd, w);
+    ++j;
+  }
+  if (k == 4) {
+    mpn_zero(out + 4 * w, w);
+    for (int i = 0; i < k; ++i)
+      accumulate(out + 4 * w, m, xp + i * m, piece_len(xn, i, m),
+                 (mp_limb_t)1 << (k - 1 - i));
+    neg[4] = false;
+  }
+}
+
+// Recovers the middle coefficients c[1 .. 2k - 3] of the product
+// polynomial from its values v at the evaluation points and c[0],
+// c[2k - 2]. Every step divides exactly; the values are overwritten and
+// t1, t2 are temporaries, all of len limbs.
+void toom_interpolate(int k, Coeff *v, const Coeff &c0, const Coeff &cinf,
+                      Coeff &t1, Coeff &t2, Coeff *c, mp_size_t len) {
+  if (k == 2) {
+    // c1 = v(1) - c0 - c2
+    coeff_sub(v[0], v[0], c0, len);
+    coeff_sub(v[0], v[0], cinf, len);
+    c[1] = v[0];
+    return;
+  }
+
+  // v1 <- c0 + c2 + c4 + ... and t2 <- c1 + c3 + ... from v(1), v(-1)
+  coeff_sub(t2, v[0], v[1], len);
+  coeff_shr(t2, 1, len);
+  coeff_add(v[0], v[0], v[1], len);
+  coeff_shr(v[0], 1, len);
+  coeff_sub(v[0], v[0], c0, len);
+  coeff_sub(v[0], v[0], cinf, len);
+
+  if (k == 3) {
+    // v1 = c2; (v(2) - c0 - 4 c2 - 16 c4) / 2 = c1 + 4 c3
+    Coeff &c2 = v[0], &odd = t2;
+    coeff_sub(v[2], v[2], c0, len);
+    coeff_mul(t1, c2, 4, len);
+    coeff_sub(v[2], v[2], t1, len);
+    coeff_mul(t1, cinf, 16, len);
+    coeff_sub(v[2], v[2], t1, len);
+    coeff_shr(v[2], 1, len);
+    coeff_sub(v[1], v[2], odd, len);
+    coeff_div(v[1], 3, len); // c3
+    coeff_sub(odd, odd, v[1], len);
+    c[1] = odd;
+    c[2] = c2;
+    c[3] = v[1];
+    return;
+  }
+
+  // Toom-4. v1 = A = c2 + c4, t2 = B = c1 + c3 + c5. From v(2), v(-2):
+  // v3 = D = c1 + 4 c3 + 16 c5 and v2 = c0 + 4 c2 + 16 c4 + 64 c6.
+  Coeff &A = v[0], &B = t2;
+  coeff_sub(v[1], v[2], v[3], len);
+  coeff_shr(v[1], 2, len);
+  coeff_add(v[2], v[2], v[3], len);
+  coeff_shr(v[2], 1, len);
+  Coeff &D = v[1];
+
+  // v2 <- C = c2 + 4 c4; c4 = (C - A) / 3 in v3, c2 = A - c4 in v0
+  coeff_sub(v[2], v[2], c0, len);
+  coeff_mul(t1, cinf, 64, len);
+  coeff_sub(v[2], v[2], t1, len);
+  coeff_shr(v[2], 2, len);
+  coeff_sub(v[3], v[2], A, len);
+  coeff_div(v[3], 3, len);
+  coeff_sub(A, A, v[3], len);
+  Coeff &c2 = v[0], &c4 = v[3];
+
+  // v4 = 8 x(1/2) products: (v4 - 64 c0 - 16 c2 - 4 c4 - c6) / 2
+  //                       = H = 16 c1 + 4 c3 + c5
+  Coeff &H = v[4];
+  coeff_mul(t1, c0, 64, len);
+  coeff_sub(H, H, t1, len);
+  coeff_mul(t1, c2, 16, len);
+  coeff_sub(H, H, t1, len);
+  coeff_mul(t1, c4, 4, len);
+  coeff_sub(H, H, t1, len);
+  coeff_sub(H, H, cinf, len);
+  coeff_shr(H, 1, len);
+
+  // F = (D - B) / 3 = c3 + 5 c5 and G = (H - B) / 3 = 5 c1 + c3
+  coeff_sub(D, D, B, len);
+  coeff_div(D, 3, len);
+  coeff_sub(H, H, B, len);
+  coeff_div(H, 3, len);
+  Coeff &F = D, &G = H;
+
+  // d = (G - F) / 5 = c1 - c5 and s = (F + G - 2B) / 3 = c1 + c5
+  coeff_sub(v[2], G, F, len);
+  coeff_div(v[2], 5, len);
+  coeff_add(G, G, F, len);
+  coeff_mul(t1, B, 2, len);
+  coeff_sub(G, G, t1, len);
+  coeff_div(G, 3, len);
+  Coeff &d = v[2], &s = G;
+
+  // c3 = B - s, c1 = (s + d) / 2, c5 = (s - d) / 2
+  coeff_sub(B, B, s, len);
+  coeff_add(F, s, d, len);
+  coeff_shr(F, 1, len);
+  coeff_sub(s, s, d, len);
+  coeff_shr(s, 1, len);
+  c[1] = F;
+  c[2] = c2;
+  c[3] = B;
+  c[4] = c4;
+  c[5] = s;
+}
+
+// Ways of Toom-Cook that give each level of the recursion at least one
+// sub-product per thread
+int team_ways(int threads) { return threads >= 7 ? 4 : threads >= 5 ? 3 : 2; }
+
+// Splits below this size cost more than the leaves they save
+constexpr size_t TOOM_MIN_LIMBS = 4096;
+
+// Slices of a Toom node's scratch: for each operand the 2k - 3 point
+// values and two temporaries of m + 1 limbs, the point products of
+// 2 (m + 1) limbs, four interpolation buffers of the same length, then
+// the scratch of the 2k - 1 children (point products first, then the
+// products of the lowest and highest pieces).
+struct ToomLayout {
+  mp_size_t m, w, len;
+  size_t eval_a, eval_b, products, interp, child[7], total;
+
+  ToomLayout(int k, size_t n, size_t child_m, size_t child_w) {
+    const int points = 2 * k - 3;
+    m = (mp_size_t)((n + k - 1) / k);
+    w = m + 1;
+    len = 2 * w;
+    eval_a = 0;
+    eval_b = eval_a + (points + 2) * w;
+    products = eval_b + (points + 2) * w;
+    interp = products + points * len;
+    total = interp + 4 * len;
+    for (int j = 0; j < 2 * k - 1; ++j) {
+      child[j] = total;
+      total += j < points ? child_w : child_m;
+    }
+  }
+};
+
+} // namespace
+
+int NTTMultiplier::toom_ways(size_t n, const MulPolicy &policy,
+                             int team_ways) {
+  auto splits = [&](size_t limbs) {
+    size_t bits = limbs * GMP_NUMB_BITS;
+    return limbs >= TOOM_MIN_LIMBS && bits >= policy.parallel_min_bits &&
+           split_product(policy, bits, bits);
+  };
+  if (!splits(n))
+    return 0;
+  if (policy.split_ways >= 2 && policy.split_ways <= 4)
+    return policy.split_ways;
+  int k = team_ways;
+  while (k < 4 && splits((n + k - 1) / k + 1))
+    ++k;
+  return k;
+}
+
+size_t NTTMultiplier::toom_scratch(size_t n, const MulPolicy &policy,
+                                   int team_ways) {
+  int k = toom_ways(n, policy, team_ways);
+  if (k == 0)
+    return 0;
+  size_t m = (n + k - 1) / k;
+  return ToomLayout(k, n, toom_scratch(m, policy, team_ways),
+                    toom_scratch(m + 1, policy, team_ways))
+      .total;
+}
+
+void NTTMultiplier::toom_multiply(mp_limb_t *rp, const mp_limb_t *ap,
+                                  mp_size_t an, const mp_limb_t *bp,
+                                  mp_size_t bn, size_t n, mp_limb_t *scratch,
+                                  const MulPolicy &policy, int team_ways) {
+  const bool square = ap == bp && an == bn;
+  const mp_size_t rn = an + bn;
+  if (an == 0 || bn == 0) {
+    mpn_zero(rp, rn);
+    return;
+  }
+
+  const int k = toom_ways(n, policy, team_ways);
+  if (k == 0) {
+    mpz_t a, b, r;
+    mpz_roinit_n(a, ap, an);
+    mpz_roinit_n(b, bp, bn);
+    mpz_init(r);
+    leaf_multiply(r, a, square ? a : b, policy);
+    mp_size_t size = mpz_size(r);
+    mpn_copyi(rp, mpz_limbs_read(r), size);
+    mpn_zero(rp + size, rn - size);
+    mpz_clear(r);
+    return;
+  }
+
+  const int points = 2 * k - 3;
+  const size_t m_limbs = (n + k - 1) / k;
+  const ToomLayout lay(k, n, toom_scratch(m_limbs, policy, team_ways),
+                       toom_scratch(m_limbs + 1, policy, team_ways));
+  const mp_size_t m = lay.m, w = lay.w, len = lay.len;
+
+  // Point values of both operands; a square evaluates once
+  mp_limb_t *ea = scratch + lay.eval_a;
+  mp_limb_t *eb = square ? ea : scratch + lay.eval_b;
+  bool na[5], nb[5];
+#pragma omp task shared(na) if (!square)
+  toom_evaluate(ap, an, k, m, ea, na, ea + points * w);
+  if (!square)
+    toom_evaluate(bp, bn, k, m, eb, nb, eb + points * w);
+#pragma omp taskwait
+  if (square)
+    std::copy(na, na + points, nb);
+
+  // 2k - 1 independent sub-products: the point values into scratch, the
+  // lowest and highest pieces straight into their place in rp
+  mp_limb_t *products = scratch + lay.products;
+  for (int j = 0; j < points; ++j) {
+#pragma omp task firstprivate(j)
+    toom_multiply(products + j * len, ea + j * w, w, eb + j * w, w, w,
+                  scratch + lay.child[j], policy, team_ways);
+  }
+  const mp_size_t a0 = piece_len(an, 0, m), b0 = piece_len(bn, 0, m);
+#pragma omp task
+  toom_multiply(rp, ap, a0, bp, b0, m, scratch + lay.child[points], policy,
+                team_ways);
+  const mp_size_t top = (k - 1) * m;
+  const mp_size_t a_top = piece_len(an, k - 1, m);
+  const mp_size_t b_top = piece_len(bn, k - 1, m);
+  const bool has_top = a_top > 0 && b_top > 0;
+  if (has_top) {
+#pragma omp task
+    toom_multiply(rp + 2 * top, ap + top, a_top, bp + top, b_top, m,
+                  scratch + lay.child[points + 1], policy, team_ways);
+  }
 #pragma omp taskwait
 
-  mpz_sub(z1, z1, z2);
-  mpz_sub(z1, z1, z0);
+  // c0 and c(2k-2) as full-length values, and the gap between them zeroed
+  // for the middle coefficients to be added into
+  mp_limb_t *interp = scratch + lay.interp;
+  Coeff c0 = {interp, false}, cinf = {interp + len, false};
+  Coeff t1 = {interp + 2 * len, false}, t2 = {interp + 3 * len, false};
+  mpn_zero(c0.p, 2 * len);
+  mpn_copyi(c0.p, rp, a0 + b0);
+  const mp_size_t top_end = has_top ? 2 * top : rn;
+  mpn_zero(rp + a0 + b0, top_end - (a0 + b0));
+  if (has_top)
+    mpn_copyi(cinf.p, rp + 2 * top, a_top + b_top);
 
-  mpz_mul_2exp(z2, z2, 2 * split);
-  mpz_mul_2exp(z1, z1, split);
-  mpz_add(rop, z2, z1);
-  mpz_add(rop, rop, z0);
+  Coeff v[5], c[6];
+  for (int j = 0; j < points; ++j)
+    v[j] = {products + j * len, na[j] != nb[j]};
+  toom_interpolate(k, v, c0, cinf, t1, t2, c, len);
 
-  mpz_clears(a_h, a_l, b_h, b_l, z2, z0, z1, sum_a, sum_b, NULL);
+  // The coefficients of a product of non-negative pieces are non-negative,
+  // and each ends inside the product, so the additions cannot carry out.
+  for (int i = 1; i <= points; ++i) {
+    mp_size_t size = len;
+    while (size > 0 && c[i].p[size - 1] == 0)
+      --size;
+    if (size > 0)
+      mpn_add(rp + i * m, rp + i * m, rn - i * m, c[i].p, size);
+  }
 }
 
-void NTTMultiplier::multiply(mpz_t rop, const mpz_t op1, const mpz_t op2) {
-  size_t max_bits = std::max(mpz_sizeinbase(op1, 2), mpz_sizeinbase(op2, 2));
+void NTTMultiplier::split_multiply(mpz_t rop, const mpz_t op1,
+                                   const mpz_t op2,
+                                   const MulPolicy &policy) {
+  const size_t an = mpz_size(op1), bn = mpz_size(op2);
+  const size_t n = std::max(an, bn);
+  const int ways = team_ways(omp_get_max_threads());
+  if (toom_ways(n, policy, ways) == 0) {
+    leaf_multiply(rop, op1, op2, policy);
+    return;
+  }
 
-  if (mpz_sgn(op1) < 0 || mpz_sgn(op2) < 0 || max_bits < 500000) {
-    mpz_mul(rop, op1, op2);
+  // rop may alias an operand whose limbs the recursion still reads
+  const int sign = mpz_sgn(op1) * mpz_sgn(op2);
+  mpz_t tmp;
+  const bool alias = rop == op1 || rop == op2;
+  if (alias)
+    mpz_init(tmp);
+  mpz_ptr dst = alias ? tmp : rop;
+
+  // From the limb allocator, so in swap mode it goes to disk like the
+  // operands it is as large as
+  const size_t scratch_bytes =
+      toom_scratch(n, policy, ways) * sizeof(mp_limb_t);
+  mp_limb_t *scratch =
+      static_cast<mp_limb_t *>(LimbArena::allocate(scratch_bytes));
+  const mp_limb_t *ap = mpz_limbs_read(op1);
+  const mp_limb_t *bp = op1 == op2 ? ap : mpz_limbs_read(op2);
+  mp_limb_t *rp = mpz_limbs_write(dst, an + bn);
+  toom_multiply(rp, ap, an, bp, bn, n, scratch, policy, ways);
+  mpz_limbs_finish(dst, sign < 0 ? -(mp_size_t)(an + bn) : an + bn);
+  LimbArena::release(scratch, scratch_bytes);
+
+  if (alias) {
+    mpz_swap(rop, tmp);
+    mpz_clear(tmp);
+  }
+}
+
+size_t NTTMultiplier::workspace_bytes(size_t bits1, size_t bits2,
+                                      int threads, const MulPolicy &policy) {
+  if (std::min(bits1, bits2) < policy.parallel_min_bits)
+    return (bits1 + bits2) / 8; // mpz_mul: at most about one product
+
+  const size_t n = (std::max(bits1, bits2) + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS;
+  const int ways = team_ways(threads);
+  if (toom_ways(n, policy, ways) != 0) {
+    // The scratch of the whole recursion, plus one leaf per thread
+    size_t leaf = n;
+    for (int k; (k = toom_ways(leaf, policy, ways)) != 0;)
+      leaf = (leaf + k - 1) / k + 1;
+    const size_t leaf_bits = leaf * GMP_NUMB_BITS;
+    return toom_scratch(n, policy, ways) * sizeof(mp_limb_t) +
+           threads * workspace_bytes(leaf_bits, leaf_bits, 1, policy);
+  }
+
+  if (leaf_engine(policy, bits1, bits2) == Engine::NTT64) {
+    // Per prime two forward arrays of 64-bit residues, all three at once
+    return 3 * 2 * sizeof(uint64_t) * transform_length64(bits1, bits2);
+  }
+  // Triple-prime NTT (and the FFT, which falls back to it): both operands'
+  // spectra, the three inverse results and the 128-bit CRT coefficients
+  const size_t len = transform_length(bits1, bits2);
+  return (2 * 3 * 4 + 3 * 4 + 16) * len;
+}
+
+void NTTMultiplier::multiply(mpz_t rop, const mpz_t op1, const mpz_t op2,
+                             const MulPolicy &policy) {
+  if (op1 == op2) {
+    square(rop, op1, policy);
     return;
   }
 
-  // Strategy for Step 1: Binary Splitting
-  // For extremely large numbers (> 20M bits), GMP's native FFT (O(n log n)) 
-  // is faster than our Parallel Karatsuba (O(n^1.58)) even on 1 core.
-  if (!use_hybrid && max_bits > 20000000) {
+  size_t bits1 = mpz_sizeinbase(op1, 2);
+  size_t bits2 = mpz_sizeinbase(op2, 2);
+
+  // A single thread gains nothing from splitting the work; its policy
+  // never leaves mpz_mul
+  if (std::min(bits1, bits2) < policy.parallel_min_bits) {
     mpz_mul(rop, op1, op2);
     return;
   }
 
-  // Strategy for Step 2: Evaluation (Newton-Raphson)
-  // We MUST use parallel Karatsuba even for huge numbers to bypass GMP's 
-  // single-threaded bottleneck during divisions/sqrt.
-  int depth = 4;
-  if (max_bits > 50000000) {
-    depth = 3; // Limit depth to 3 levels (27 tasks) for huge numbers
-  }
+  // Products too large for one transform, or past the policy's split
+  // point, go through parallel Toom-Cook first.
+  in_team([&] { split_multiply(rop, op1, op2, policy); });
+}
 
-#pragma omp parallel
-    {
-#pragma omp single
-    parallel_mul_recursive(rop, op1, op2, depth);
+void NTTMultiplier::square(mpz_t rop, const mpz_t op,
+                           const MulPolicy &policy) {
+  size_t bits = mpz_sizeinbase(op, 2);
+  if (bits < policy.parallel_min_bits) {
+    mpz_mul(rop, op, op);
+    return;
   }
+
+  // Every sub-product of a square is itself a square, so each leaf keeps
+  // the one-forward-transform saving of ntt_square.
+  in_team([&] { split_multiply(rop, op, op, policy); });
 }
 
 } // namespace pi
@@ -0,0 +1,250 @@
+#include "ntt_kernel.hpp"
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define PI_HAVE_X86 1
+#endif
+
+#if defined(__GNUC__)
+#define PI_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define PI_TARGET_AVX2
+#endif
+
+namespace pi {
+namespace simd {
+
+bool cpu_has_avx2() {
+#if defined(PI_HAVE_X86) && defined(__GNUC__)
+  return __builtin_cpu_supports("avx2");
+#elif defined(__AVX2__)
+  return true;
+#else
+  return false;
+#endif
+}
+
+#ifdef PI_HAVE_X86
+
+namespace {
+
+// Eight Montgomery products at once. _mm256_mul_epu32 only multiplies the
+// even 32-bit lanes, so even and odd lanes are reduced separately and the
+// high halves of the 64-bit sums are blended back together.
+PI_TARGET_AVX2 inline __m256i mont_mul(__m256i a, __m256i b, __m256i mod,
+                                       __m256i n_prime) {
+  __m256i p_even = _mm256_mul_epu32(a, b);
+  __m256i p_odd =
+      _mm256_mul_epu32(_mm256_srli_epi64(a, 32), _mm256_srli_epi64(b, 32));
+  __m256i m_even = _mm256_mul_epu32(p_even, n_prime);
+  __m256i m_odd = _mm256_mul_epu32(p_odd, n_prime);
+  __m256i t_even = _mm256_add_epi64(p_even, _mm256_mul_epu32(m_even, mod));
+  __m256i t_odd = _mm256_add_epi64(p_odd, _mm256_mul_epu32(m_odd, mod));
+  __m256i r = _mm256_blend_epi32(_mm256_srli_epi64(t_even, 32), t_odd, 0xAA);
+  return _mm256_min_epu32(r, _mm256_sub_epi32(r, mod));
+}
+
+// Values are below 2^30, so a wrapped difference is always the larger one
+PI_TARGET_AVX2 inline __m256i mod_add(__m256i a, __m256i b, __m256i mod) {
+  __m256i s = _mm256_add_epi32(a, b);
+  return _mm256_min_epu32(s, _mm256_sub_epi32(s, mod));
+}
+
+PI_TARGET_AVX2 inline __m256i mod_sub(__m256i a, __m256i b, __m256i mod) {
+  __m256i d = _mm256_sub_epi32(a, b);
+  return _mm256_min_epu32(d, _mm256_add_epi32(d, mod));
+}
+
+template <bool Bcast>
+PI_TARGET_AVX2 inline void dif_loop(uint32_t *x, uint32_t *y,
+                                    const uint32_t *w, __m256i bcast,
+                                    size_t count, __m256i mod,
+                                    __m256i n_prime) {
+  for (size_t j = 0; j < count; j += 8) {
+    __m256i u = _mm256_loadu_si256((const __m256i *)(x + j));
+    __m256i v = _mm256_loadu_si256((const __m256i *)(y + j));
+    __m256i vw =
+        Bcast ? bcast : _mm256_loadu_si256((const __m256i *)(w + j));
+    _mm256_storeu_si256((__m256i *)(x + j), mod_add(u, v, mod));
+    _mm256_storeu_si256((__m256i *)(y + j),
+                        mont_mul(mod_sub(u, v, mod), vw, mod, n_prime));
+  }
+}
+
+template <bool Bcast>
+PI_TARGET_AVX2 inline void dit_loop(uint32_t *x, uint32_t *y,
+                                    const uint32_t *w, __m256i bcast,
+                                    size_t count, __m256i mod,
+                                    __m256i n_prime) {
+  for (size_t j = 0; j < count; j += 8) {
+    __m256i u = _mm256_loadu_si256((const __m256i *)(x + j));
+    __m256i v = _mm256_loadu_si256((const __m256i *)(y + j));
+    __m256i vw =
+        Bcast ? bcast : _mm256_loadu_si256((const __m256i *)(w + j));
+    v = mont_mul(v, vw, mod, n_prime);
+    _mm256_storeu_si256((__m256i *)(x + j), mod_add(u, v, mod));
+    _mm256_storeu_si256((__m256i *)(y + j), mod_sub(u, v, mod));
+  }
+}
+
+// One stage inside a register over lane pairs (i, i + h): partner holds
+// each lane's pair value and the Upper blend mask marks the y lanes.
+template <int Upper, bool UnitTwiddle>
+PI_TARGET_AVX2 inline __m256i dif_lanes(__m256i x, __m256i partner,
+                                        __m256i w, __m256i mod,
+                                        __m256i n_prime) {
+  __m256i sum = mod_add(x, partner, mod);
+  __m256i diff = mod_sub(partner, x, mod);
+  if (!UnitTwiddle)
+    diff = mont_mul(diff, w, mod, n_prime);
+  return _mm256_blend_epi32(sum, diff, Upper);
+}
+
+template <int Upper, bool UnitTwiddle>
+PI_TARGET_AVX2 inline __m256i dit_lanes(__m256i x, __m256i partner,
+                                        __m256i w, __m256i mod,
+                                        __m256i n_prime) {
+  __m256i v = _mm256_blend_epi32(partner, x, Upper);
+  if (!UnitTwiddle)
+    v = mont_mul(v, w, mod, n_prime);
+  return _mm256_blend_epi32(mod_add(x, v, mod), mod_sub(partner, v, mod),
+                            Upper);
+}
+
+PI_TARGET_AVX2 inline __m256i swap_h4(__m256i x) {
+  return _mm256_permute2x128_si256(x, x, 0x01);
+}
+PI_TARGET_AVX2 inline __m256i swap_h2(__m256i x) {
+  return _mm256_shuffle_epi32(x, 0x4E);
+}
+PI_TARGET_AVX2 inline __m256i swap_h1(__m256i x) {
+  return _mm256_shuffle_epi32(x, 0xB1);
+}
+
+// [w8[0..3] x 2] and [w4[0..1] x 4]
+PI_TARGET_AVX2 inline void small_twiddles(const uint32_t *w8,
+                                          const uint32_t *w4, __m256i &v8,
+                                          __m256i &v4) {
+  v8 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)w8));
+  uint64_t pair;
+  std::memcpy(&pair, w4, sizeof(pair));
+  v4 = _mm256_set1_epi64x((long long)pair);
+}
+
+} // namespace
+
+PI_TARGET_AVX2 void dif_butterflies_avx2(uint32_t *x, uint32_t *y,
+                                         const uint32_t *w, size_t count,
+                                         uint32_t mod, uint32_t n_prime) {
+  dif_loop<false>(x, y, w, _mm256_setzero_si256(), count,
+                  _mm256_set1_epi32((int)mod), _mm256_set1_epi32((int)n_prime));
+}
+
+PI_TARGET_AVX2 void dit_butterflies_avx2(uint32_t *x, uint32_t *y,
+                                         const uint32_t *w, size_t count,
+                                         uint32_t mod, uint32_t n_prime) {
+  dit_loop<false>(x, y, w, _mm256_setzero_si256(), count,
+                  _mm256_set1_epi32((int)mod), _mm256_set1_epi32((int)n_prime));
+}
+
+PI_TARGET_AVX2 void dif_butterflies_bcast_avx2(uint32_t *x, uint32_t *y,
+                                               uint32_t w, size_t count,
+                                               uint32_t mod,
+                                               uint32_t n_prime) {
+  dif_loop<true>(x, y, nullptr, _mm256_set1_epi32((int)w), count,
+                 _mm256_set1_epi32((int)mod), _mm256_set1_epi32((int)n_prime));
+}
+
+PI_TARGET_AVX2 void dit_butterflies_bcast_avx2(uint32_t *x, uint32_t *y,
+                                               uint32_t w, size_t count,
+                                               uint32_t mod,
+                                               uint32_t n_prime) {
+  dit_loop<true>(x, y, nullptr, _mm256_set1_epi32((int)w), count,
+                 _mm256_set1_epi32((int)mod), _mm256_set1_epi32((int)n_prime));
+}
+
+PI_TARGET_AVX2 void dif_tail_avx2(uint32_t *a, size_t n, const uint32_t *w8,
+                                  const uint32_t *w4, uint32_t mod,
+                                  uint32_t n_prime) {
+  const __m256i vmod = _mm256_set1_epi32((int)mod);
+  const __m256i vnp = _mm256_set1_epi32((int)n_prime);
+  __m256i v8, v4;
+  small_twiddles(w8, w4, v8, v4);
+  for (size_t i = 0; i < n; i += 8) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+    x = dif_lanes<0xF0, false>(x, swap_h4(x), v8, vmod, vnp);
+    x = dif_lanes<0xCC, false>(x, swap_h2(x), v4, vmod, vnp);
+    x = dif_lanes<0xAA, true>(x, swap_h1(x), v4, vmod, vnp);
+    _mm256_storeu_si256((__m256i *)(a + i), x);
+  }
+}
+
+PI_TARGET_AVX2 void dit_head_avx2(uint32_t *a, size_t n, const uint32_t *w8,
+                                  const uint32_t *w4, uint32_t mod,
+                                  uint32_t n_prime) {
+  const __m256i vmod = _mm256_set1_epi32((int)mod);
+  const __m256i vnp = _mm256_set1_epi32((int)n_prime);
+  __m256i v8, v4;
+  small_twiddles(w8, w4, v8, v4);
+  for (size_t i = 0; i < n; i += 8) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+    x = dit_lanes<0xAA, true>(x, swap_h1(x), v4, vmod, vnp);
+    x = dit_lanes<0xCC, false>(x, swap_h2(x), v4, vmod, vnp);
+    x = dit_lanes<0xF0, false>(x, swap_h4(x), v8, vmod, vnp);
+    _mm256_storeu_si256((__m256i *)(a + i), x);
+  }
+}
+
+PI_TARGET_AVX2 void scale_powers_avx2(uint32_t *x, size_t count,
+                                      const uint32_t *first8, uint32_t step8,
+                                      uint32_t mod, uint32_t n_prime) {
+  const __m256i vmod = _mm256_set1_epi32((int)mod);
+  const __m256i vnp = _mm256_set1_epi32((int)n_prime);
+  const __m256i vstep = _mm256_set1_epi32((int)step8);
+  __m256i cur = _mm256_loadu_si256((const __m256i *)first8);
+  for (size_t j = 0; j < count; j += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(x + j));
+    _mm256_storeu_si256((__m256i *)(x + j), mont_mul(v, cur, vmod, vnp));
+    cur = mont_mul(cur, vstep, vmod, vnp);
+  }
+}
+
+#else
+
+// Unreachable: cpu_has_avx2() is false off x86-64
+void dif_butterflies_avx2(uint32_t *, uint32_t *, const uint32_t *, size_t,
+                          uint32_t, uint32_t) {
+  std::abort();
+}
+void dit_butterflies_avx2(uint32_t *, uint32_t *, const uint32_t *, size_t,
+                          uint32_t, uint32_t) {
+  std::abort();
+}
+void dif_butterflies_bcast_avx2(uint32_t *, uint32_t *, uint32_t, size_t,
+                                uint32_t, uint32_t) {
+  std::abort();
+}
+void dit_butterflies_bcast_avx2(uint32_t *, uint32_t *, uint32_t, size_t,
+                                uint32_t, uint32_t) {
+  std::abort();
+}
+void dif_tail_avx2(uint32_t *, size_t, const uint32_t *, const uint32_t *,
+                   uint32_t, uint32_t) {
+  std::abort();
+}
+void dit_head_avx2(uint32_t *, size_t, const uint32_t *, const uint32_t *,
+                   uint32_t, uint32_t) {
+  std::abort();
+}
+void scale_powers_avx2(uint32_t *, size_t, const uint32_t *, uint32_t,
+                       uint32_t, uint32_t) {
+  std::abort();
+}
+
+#endif
+
+} // namespace simd
+} // namespace pi
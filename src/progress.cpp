@@ -0,0 +1,42 @@
+#include "progress.hpp"
+#include <cstdio>
+
+namespace pi {
+
+ProgressSampler::ProgressSampler(std::function<int64_t()> read, int64_t total,
+                                 std::string label, std::string unit,
+                                 std::chrono::milliseconds interval)
+    : read(std::move(read)), total(total), label(std::move(label)),
+      unit(std::move(unit)), interval(interval) {
+  worker = std::thread([this] { run(); });
+}
+
+ProgressSampler::~ProgressSampler() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_one();
+  worker.join();
+  print(read());
+}
+
+void ProgressSampler::print(int64_t done) const {
+  printf("\r%s: %lld / %lld %s", label.c_str(), (long long)done,
+         (long long)total, unit.c_str());
+  fflush(stdout);
+}
+
+void ProgressSampler::run() {
+  int64_t shown = -1;
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!wake.wait_for(lock, interval, [this] { return stopping; })) {
+    int64_t done = read();
+    if (done != shown) {
+      print(done);
+      shown = done;
+    }
+  }
+}
+
+} // namespace pi
@@ -0,0 +1,136 @@
+#include "swap_space.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace pi {
+
+size_t SwapSpace::threshold = 0;
+std::string SwapSpace::directory;
+
+#ifdef _WIN32
+
+bool SwapSpace::enable(const std::string &, size_t) {
+  std::fprintf(stderr, "Swap mode needs POSIX file mappings and is not "
+                       "available on this platform\n");
+  return false;
+}
+
+void *SwapSpace::allocate(size_t) { std::abort(); }
+void *SwapSpace::reallocate(void *, size_t, size_t) { std::abort(); }
+void SwapSpace::release(void *, size_t) { std::abort(); }
+
+#else
+
+namespace {
+
+// Kept in the first page of every mapping, ahead of the block
+struct Header {
+  int fd;
+  size_t length;
+};
+
+size_t page_size() {
+  static const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  return page;
+}
+
+size_t mapping_length(size_t bytes) {
+  const size_t page = page_size();
+  return page + (bytes + page - 1) / page * page;
+}
+
+[[noreturn]] void fail(const char *what, size_t bytes, int err) {
+  std::fprintf(stderr, "Swap space: cannot %s %zu bytes: %s\n", what, bytes,
+               std::strerror(err));
+  std::abort();
+}
+
+// A new unlinked file in dir; the open descriptor keeps it alive and the
+// kernel reclaims it even if the process dies
+int open_swap_file(const std::string &dir) {
+  std::string path = dir + "/pi_calc.swap.XXXXXX";
+  int fd = mkstemp(&path[0]);
+  if (fd >= 0)
+    unlink(path.c_str());
+  return fd;
+}
+
+// Reserves the blocks so a full disk fails here rather than as a SIGBUS
+// on first touch
+int reserve(int fd, size_t length) {
+  return posix_fallocate(fd, 0, (off_t)length);
+}
+
+} // namespace
+
+bool SwapSpace::enable(const std::string &dir, size_t min_bytes) {
+  int fd = open_swap_file(dir);
+  if (fd < 0) {
+    std::fprintf(stderr, "Swap directory %s is not writable: %s\n",
+                 dir.c_str(), std::strerror(errno));
+    return false;
+  }
+  close(fd);
+  directory = dir;
+  threshold = min_bytes > 0 ? min_bytes : 1;
+  return true;
+}
+
+void *SwapSpace::allocate(size_t bytes) {
+  const size_t length = mapping_length(bytes);
+  int fd = open_swap_file(directory);
+  if (fd < 0)
+    fail("create a file for", bytes, errno);
+  if (int err = reserve(fd, length))
+    fail("reserve disk space for", bytes, err);
+  void *base =
+      mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED)
+    fail("map", bytes, errno);
+  *static_cast<Header *>(base) = {fd, length};
+  return static_cast<char *>(base) + page_size();
+}
+
+void *SwapSpace::reallocate(void *p, [[maybe_unused]] size_t old_bytes,
+                             size_t new_bytes) {
+#ifdef __linux__
+  char *base = static_cast<char *>(p) - page_size();
+  Header h = *reinterpret_cast<Header *>(base);
+  const size_t length = mapping_length(new_bytes);
+  if (length > h.length) {
+    if (int err = reserve(h.fd, length))
+      fail("reserve disk space for", new_bytes, err);
+  }
+  void *moved = mremap(base, h.length, length, MREMAP_MAYMOVE);
+  if (moved == MAP_FAILED)
+    fail("remap", new_bytes, errno);
+  if (length < h.length && ftruncate(h.fd, (off_t)length) != 0)
+    fail("shrink", new_bytes, errno);
+  *static_cast<Header *>(moved) = {h.fd, length};
+  return static_cast<char *>(moved) + page_size();
+#else
+  void *q = allocate(new_bytes);
+  std::memcpy(q, p, old_bytes < new_bytes ? old_bytes : new_bytes);
+  release(p, old_bytes);
+  return q;
+#endif
+}
+
+void SwapSpace::release(void *p, size_t) {
+  char *base = static_cast<char *>(p) - page_size();
+  Header h = *reinterpret_cast<Header *>(base);
+  munmap(base, h.length);
+  close(h.fd); // last reference: the file and its dirty pages are dropped
+}
+
+#endif
+
+} // namespace pi
@@ -5,6 +5,7 @@
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <algorithm>
 #include <map>
 #include <sstream>
 #include <omp.h>
@@ -15,6 +16,110 @@
 
 namespace pi {
 
+namespace {
+
+uint64_t mul_mod(uint64_t a, uint64_t b, uint64_t m) {
+  // Below 2^32 the product fits a word, and a 64-bit division is cheaper
+  return m >> 32 ? (uint64_t)((__uint128_t)a * b % m) : a * b % m;
+}
+
+// 2^e mod m
+uint64_t pow2_mod(uint64_t e, uint64_t m) {
+  uint64_t r = 1 % m;
+  for (int bit = 63 - __builtin_clzll(e | 1); bit >= 0; --bit) {
+    r = mul_mod(r, r, m);
+    if ((e >> bit) & 1) {
+      r <<= 1;
+      if (r >= m)
+        r -= m;
+    }
+  }
+  return r;
+}
+
+// frac(2^e / m) as a 64-bit fraction, rounded down
+uint64_t pow2_frac(int64_t e, uint64_t m) {
+  if (e <= -64)
+    return 0;
+  if (e < 0)
+    return (1ULL << (64 + e)) / m;
+  const uint64_t r = pow2_mod((uint64_t)e, m);
+  if (m >> 32)
+    return (uint64_t)(((__uint128_t)r << 64) / m);
+  const uint64_t hi = (r << 32) / m, rem = (r << 32) % m;
+  return hi << 32 | (rem << 32) / m;
+}
+
+} // namespace
+
+int PiValidator::bbp_hex_digits(int64_t position, char *out) {
+  // Bellard: pi = 2^-6 sum (-1)^k 2^-10k (-2^5/(4k+1) - 1/(4k+3)
+  //   + 2^8/(10k+1) - 2^6/(10k+3) - 2^2/(10k+5) - 2^2/(10k+7) + 1/(10k+9)),
+  // here times 2^(4 position), as {shift, sign, a, b} for 2^shift/(ak+b)
+  static const int terms[7][4] = {{5, -1, 4, 1},  {0, -1, 4, 3},
+                                  {8, 1, 10, 1},  {6, -1, 10, 3},
+                                  {2, -1, 10, 5}, {2, -1, 10, 7},
+                                  {0, 1, 10, 9}};
+  const int64_t top = 4 * position - 6;
+  // Past here every term is below 2^-64
+  const int64_t count = (top + 8 + 64) / 10 + 1;
+
+  uint64_t sum = 0;
+#pragma omp parallel for reduction(+ : sum) schedule(static, 4096)
+  for (int64_t k = 0; k < count; ++k) {
+    uint64_t t = 0;
+    for (const int *term : terms) {
+      const uint64_t f = pow2_frac(top - 10 * k + term[0],
+                                   (uint64_t)(term[2] * k + term[3]));
+      t += term[1] > 0 ? f : -f;
+    }
+    sum += k & 1 ? -t : t;
+  }
+
+  for (int i = 0; i < 16; ++i)
+    out[i] = "0123456789abcdef"[(sum >> (60 - 4 * i)) & 15];
+  // Each term is short of its value by under one unit; the tail adds
+  // less than one more
+  const uint64_t error = 7 * (uint64_t)count + 1;
+  const uint64_t lo = sum - error, hi = sum + error;
+  if (lo > sum || hi < sum)
+    return 0; // the interval wraps through a whole number
+  int certain = 0;
+  while (certain < 16 && lo >> (60 - 4 * certain) == hi >> (60 - 4 * certain))
+    ++certain;
+  return certain;
+}
+
+std::vector<HexCheck> PiValidator::check_hex(const mpz_t y, size_t bits,
+                                             int64_t hex_digits) {
+  std::vector<HexCheck> checks;
+  const int64_t end = std::max<int64_t>(0, hex_digits - 16);
+  for (int64_t position : {end, end / 2, end / 4}) {
+    char digits[16];
+    int certain = bbp_hex_digits(position, digits);
+    // Too near a digit boundary for the formula: a window a little
+    // earlier will not be
+    while (certain < 6 && position >= 8) {
+      position -= 8;
+      certain = bbp_hex_digits(position, digits);
+    }
+    HexCheck check;
+    check.position = position;
+    check.expected.assign(digits, certain);
+    for (int i = 0; i < certain; ++i) {
+      // Digit position + 1 + i spans the 4 bits below 2^-4(position + i)
+      const int64_t low = (int64_t)bits - 4 * (position + 1 + i);
+      int digit = 0;
+      for (int b = 3; b >= 0; --b)
+        digit = digit << 1 | (low + b >= 0 && mpz_tstbit(y, low + b));
+      check.actual += "0123456789abcdef"[digit];
+    }
+    check.passed = certain > 0 && check.expected == check.actual;
+    checks.push_back(check);
+  }
+  return checks;
+}
+
 uint64_t PiValidator::calculate_hash(const char *str, int64_t len) {
   const uint64_t MOD = (1ULL << 61) - 1; // Mersenne prime M61
   __uint128_t h = 0;
@@ -130,7 +235,7 @@ void PiValidator::write_validation_file(
   out << "================================================================================\n\n";
   out << "Validation Version:    4.0.0\n\n";
   out << "Program:               Pi-Calc v4\n";
-  out << "Architecture:          C++ / OpenMP Task Pool / Parallel Karatsuba 3-Way\n";
+  out << "Architecture:          C++ / OpenMP Task Pool / Parallel Toom-Cook 2/3/4-Way\n";
   out << "Algorithm:             Chudnovsky (1988) with Binary Splitting\n";
   out << "Computation Mode:      RAM Only (Saturated Multi-core Engine)\n";
   out << "Threading Mode:        OpenMP Task Pool  ->  " << threads << " logical cores\n\n";
@@ -0,0 +1,74 @@
+// Checks BigInt::parallel_div against mpz_fdiv_q for quotients just
+// shorter than, exactly as long as and just longer than the requested
+// bits, including those whose numerator barely clears a power of two
+// times the denominator.
+#include "bigint.hpp"
+#include <cstdio>
+#include <gmp.h>
+
+using namespace pi;
+
+namespace {
+
+int check(gmp_randstate_t rng, size_t den_bits, size_t bits) {
+  int failures = 0;
+  mpz_t num, den, q, r, exact, got;
+  mpz_inits(num, den, q, r, exact, got, NULL);
+  mpz_urandomb(den, rng, den_bits);
+  mpz_setbit(den, den_bits - 1);
+  for (size_t length = bits - 1; length <= bits + 2; ++length) {
+    for (int shape = 0; shape < 3; ++shape) {
+      // Quotients 2^(length - 1), random, and 2^length - 1
+      if (shape == 0) {
+        mpz_set_ui(q, 0);
+      } else if (shape == 1) {
+        mpz_urandomb(q, rng, length - 1);
+      } else {
+        mpz_set_ui(q, 0);
+        mpz_setbit(q, length - 1);
+        mpz_sub_ui(q, q, 1);
+      }
+      mpz_setbit(q, length - 1);
+      mpz_urandomm(r, rng, den);
+      mpz_mul(num, q, den);
+      mpz_add(num, num, r);
+
+      BigInt::parallel_div(got, num, den, bits);
+      mpz_fdiv_q(exact, num, den);
+      bool ok;
+      if (length <= bits) {
+        ok = mpz_cmp(got, exact) == 0;
+      } else {
+        // The top `bits` within a unit, zeros below
+        const size_t low = length - bits;
+        mpz_fdiv_q_2exp(exact, exact, low);
+        mpz_fdiv_q_2exp(r, got, low);
+        mpz_sub(r, exact, r);
+        ok = mpz_scan1(got, 0) >= low && mpz_sgn(r) >= 0 &&
+             mpz_cmp_ui(r, 1) <= 0;
+      }
+      if (!ok) {
+        std::printf("FAIL den %zu bits, quotient %zu bits, bits %zu, "
+                    "shape %d\n", den_bits, length, bits, shape);
+        ++failures;
+      }
+    }
+  }
+  mpz_clears(num, den, q, r, exact, got, NULL);
+  return failures;
+}
+
+} // namespace
+
+int main() {
+  gmp_randstate_t rng;
+  gmp_randinit_default(rng);
+  gmp_randseed_ui(rng, 20261016);
+  const int failures = check(rng, 600000, 2000000) +
+                       check(rng, 1000000, 500000) +
+                       check(rng, 8000000, 500000);
+  gmp_randclear(rng);
+  if (failures == 0)
+    std::printf("parallel_div matches mpz_fdiv_q\n");
+  return failures == 0 ? 0 : 1;
+}